@@ -18,7 +18,7 @@ def find_tests():
     suites = []
     for f in os.listdir('test'):
         n, ext = os.path.splitext(f)
-        if ext == '.py' and n not in ('__init__',):
+        if ext == '.py' and n not in ('__init__', 'bench'):
             m = importlib.import_module('test.' + n)
             suite = unittest.defaultTestLoader.loadTestsFromModule(m)
             suites.append(suite)
@@ -59,6 +59,36 @@ class Test(Command):
             raise SystemExit(1)
 
 
+class Bench(Command):
+
+    description = "run benchmarks after in-place build, writing the results as JSON"
+    user_options = [
+        ('output=', 'o', 'file to write the results to [default: bench_output.json]'),
+        ('corpus-dir=', 'c', 'directory in which to create the benchmark archives, re-used if it exists'),
+        ('min-time=', None, 'minimum number of seconds to run each benchmark for [default: 0.5]'),
+    ]
+    sub_commands = [
+        ('build', None),
+    ]
+
+    def initialize_options(self):
+        self.output = 'bench_output.json'
+        self.corpus_dir = None
+        self.min_time = 0.5
+
+    def finalize_options(self):
+        self.output = os.path.abspath(self.output)
+        self.min_time = float(self.min_time)
+
+    def run(self):
+        for cmd_name in self.get_sub_commands():
+            self.run_command(cmd_name)
+        build = self.get_finalized_command('build')
+        sys.path.insert(0, os.path.abspath(build.build_lib))
+        bench = importlib.import_module('test.bench')
+        bench.main(output=self.output, corpus_dir=self.corpus_dir, min_time=self.min_time)
+
+
 def include_dirs():
     ans = []
     if 'UNRAR_INCLUDE' in os.environ:
@@ -84,7 +114,7 @@ def macros():
 
 
 setup(
-    cmdclass={'test': Test},
+    cmdclass={'test': Test, 'bench': Bench},
     ext_modules=[
         Extension(
             str('unrardll.unrar'),
@@ -5,10 +5,15 @@
 from __future__ import absolute_import, division, print_function, unicode_literals
 
 import errno
+import io
+import json
 import os
 import sys
+import threading
+import time
 from binascii import crc32
-from collections import namedtuple, defaultdict
+from hashlib import sha1
+from collections import namedtuple, defaultdict, deque, OrderedDict
 from contextlib import contextmanager
 
 from . import unrar
@@ -32,62 +37,57 @@ else:
     def make_long_path_useable(path):
         return path
 
-# local_open() opens a file that wont be inherited by child processes  {{{
-if sys.version_info.major < 3:
-    if iswindows:
-        def local_open(name, mode='r', bufsize=-1):
-            mode += 'N'
-            return open(name, mode, bufsize)
-    elif isosx:
-        import fcntl
-        FIOCLEX = 0x20006601
-
-        def local_open(name, mode='r', bufsize=-1):
-            ans = open(name, mode, bufsize)
-            try:
-                fcntl.ioctl(ans.fileno(), FIOCLEX)
-            except EnvironmentError:
-                fcntl.fcntl(ans, fcntl.F_SETFD, fcntl.fcntl(ans, fcntl.F_GETFD) | fcntl.FD_CLOEXEC)
-            return ans
-    else:
-        import fcntl
-        try:
-            cloexec_flag = fcntl.FD_CLOEXEC
-        except AttributeError:
-            cloexec_flag = 1
-        supports_mode_e = False
-
-        def local_open(name, mode='r', bufsize=-1):
-            global supports_mode_e
-            mode += 'e'
-            ans = open(name, mode, bufsize)
-            if supports_mode_e:
-                return ans
-            old = fcntl.fcntl(ans, fcntl.F_GETFD)
-            if not (old & cloexec_flag):
-                fcntl.fcntl(ans, fcntl.F_SETFD, old | cloexec_flag)
-            else:
-                supports_mode_e = True
-            return ans
-else:
-    local_open = open
-# }}}
+# Files opened by python 3 are not inherited by child processes
+local_open = open
 
 
 def is_useful(h):
     return not (h['is_dir'] or h['redir_type'])
 
 
+class VolumeResolver(object):
+    '''
+    Locates the volumes of multi-volume archives that are not all available
+    locally, for example ones stored remotely. Both methods are called from
+    the thread doing the extraction.
+    '''
+
+    def find(self, path):
+        '''
+        Called when the volume at path, as computed by unrar from the name of
+        the previous volume, does not exist. Return the path of a local copy
+        of the volume, which must be different from path, or None to abort.
+        '''
+        return None
+
+    def opened(self, path):
+        '''
+        Called after unrar switches to the volume at path, for example to
+        start fetching the volume after it in the background.
+        '''
+        pass
+
+
 class Callback(object):
 
-    def __init__(self, pw=None):
+    def __init__(self, pw=None, volume_resolver=None):
         self.pw = type('')(pw) if pw is not None else None
         self.password_requested = False
+        self.volume_resolver = volume_resolver
 
     def _get_password(self):
         self.password_requested = True
         return self.pw
 
+    def _find_volume(self, path):
+        if self.volume_resolver is not None:
+            ans = self.volume_resolver.find(path)
+            return None if ans is None else type('')(ans)
+
+    def _volume_opened(self, path):
+        if self.volume_resolver is not None:
+            self.volume_resolver.opened(path)
+
     def _process_data(self, data):
         pass
 
@@ -122,6 +122,22 @@ def ensure_dir(path):
             raise
 
 
+def atomic_write(path, raw):
+    ' Replace the file at path with raw, via a temporary file of its own, so that concurrent writers do not clash '
+    import tempfile
+    fd, tmp = tempfile.mkstemp(dir=os.path.dirname(os.path.abspath(path)), prefix=os.path.basename(path) + '.', suffix='.tmp')
+    try:
+        with os.fdopen(fd, 'wb') as f:
+            f.write(raw)
+        os.replace(tmp, path)
+    except BaseException:
+        try:
+            os.remove(tmp)
+        except EnvironmentError:
+            pass
+        raise
+
+
 class PasswordError(ValueError):
     pass
 
@@ -150,40 +166,211 @@ def do_func(func, archive_path, f, c, *args):
         raise
 
 
-@contextmanager
-def open_archive(archive_path, callback, mode=unrar.RAR_OM_LIST, get_comment=False):
+def open_handle(archive_path, callback, mode=unrar.RAR_OM_LIST, get_comment=False, blocking=True):
+    ''' Like open_archive() except that the handle must be closed with unrar.close_archive() '''
     try:
-        f = unrar.open_archive(archive_path, callback, mode, get_comment)
-        if get_comment:
-            f, c = f
+        return unrar.open_archive(archive_path, callback, mode, get_comment, blocking)
     except unrar.UNRARError as e:
         m = e.args[0]
         raise OSError((errno.ENOENT, 'Failed to open archive at: %r with underlying unrar error code: %s' % (
             archive_path, m), archive_path))
+
+
+@contextmanager
+def open_archive(archive_path, callback, mode=unrar.RAR_OM_LIST, get_comment=False, blocking=True):
+    f = open_handle(archive_path, callback, mode, get_comment, blocking)
+    if get_comment:
+        f, c = f
     yield (f, c) if get_comment else f
     unrar.close_archive(f)
     del f
 
 
-def headers(archive_path, password=None, mode=unrar.RAR_OM_LIST):
-    ''' Yield the headers for all files in the archive '''
-    c = Callback(pw=password)
+class MemoryArchive(object):
+    '''
+    Make an archive that is in memory, as a bytes-like object or a readable
+    file like object such as an HTTP response, available at a path that can be
+    passed to all the functions in this module. Use as a context manager::
+
+        with MemoryArchive(data) as path:
+            extract(path, dest)
+
+    The unrar DLL can only open archives by path. On Linux the data is kept
+    in an anonymous memory file (memfd_create()) reached via /proc, so nothing
+    is written to disk. Elsewhere a temporary file is used. Multi-volume
+    archives are not supported.
+    '''
+
+    def __init__(self, data, name='archive.rar'):
+        self.fd, self.tmp_path = -1, None
+        memfd_create = getattr(os, 'memfd_create', None)
+        if memfd_create is not None and os.path.isdir('/proc/self/fd'):
+            self.fd = memfd_create(name, os.MFD_CLOEXEC)
+            self.path = '/proc/self/fd/%d' % self.fd
+        else:
+            import tempfile
+            self.fd, self.tmp_path = tempfile.mkstemp(suffix='-' + name)
+            self.path = self.tmp_path
+        try:
+            self.write(data)
+        except BaseException:
+            self.close()
+            raise
+        if self.tmp_path is not None:
+            # Windows cannot share a file opened by mkstemp()
+            os.close(self.fd)
+            self.fd = -1
+
+    def write(self, data):
+        if hasattr(data, 'read'):
+            while True:
+                chunk = data.read(callback_buffer_size)
+                if not chunk:
+                    break
+                self.write(chunk)
+            return
+        data = memoryview(data).cast('B')
+        while data:
+            data = data[os.write(self.fd, data):]
+
+    def __enter__(self):
+        return self.path
+
+    def __exit__(self, *a):
+        self.close()
+
+    def close(self):
+        if self.fd > -1:
+            os.close(self.fd)
+            self.fd = -1
+        if self.tmp_path is not None:
+            os.remove(self.tmp_path)
+            self.tmp_path = None
+
+
+class MemberFilter(object):
+    '''
+    Select members natively, python is not called at all for the members that
+    do not match, see unrar.set_filter(). names is a collection of exact names
+    and globs of fnmatch style patterns, with / as the separator, a member
+    matches if its name is in either. If both are None, all names match. The
+    unpacked size must be in [min_size, max_size] and dirs and links select
+    whether directories and symlinks (and other redirections) match.
+    '''
+
+    def __init__(self, names=None, globs=None, min_size=0, max_size=None, dirs=True, links=True):
+        self.names = None if names is None else [type('')(x) for x in names]
+        self.globs = None if globs is None else [type('')(x) for x in globs]
+        self.min_size, self.max_size = min_size, max_size
+        self.dirs, self.links = dirs, links
+
+    def apply(self, f):
+        unrar.set_filter(
+            f, self.names, self.globs, self.min_size, (1 << 64) - 1 if self.max_size is None else self.max_size,
+            not self.dirs, not self.links)
+
+
+def headers(archive_path, password=None, mode=unrar.RAR_OM_LIST, volume_resolver=None, member_filter=None, normalize_names=False):
+    '''
+    Yield the headers for all files in the archive, or only those selected by member_filter, a MemberFilter.
+    With normalize_names the file names use / as the separator on all platforms. The headers are read
+    as they are consumed, use list_headers() to read all of them in a single call.
+    '''
+    c = Callback(pw=password, volume_resolver=volume_resolver)
     archive_path = type('')(archive_path)
     with open_archive(archive_path, c, mode) as f:
+        if member_filter is not None:
+            member_filter.apply(f)
+        if normalize_names:
+            unrar.set_name_options(f, unrar.NAMES_NORMALIZE)
         while True:
             h = do_func(unrar.read_next_header, archive_path, f, c)
             if h is None:
                 break
             yield h
-            do_func(unrar.process_file, archive_path, f, c)
+            do_func(unrar.process_file, archive_path, f, c, unrar.RAR_SKIP)
             c.reset()
 
 
-def names(archive_path, only_useful=False, password=None):
-    ''' Yield the archive file names for all files in the archive '''
-    for h in headers(archive_path, password=password):
+def list_headers(archive_path, password=None, mode=unrar.RAR_OM_LIST, volume_resolver=None, member_filter=None, normalize_names=False):
+    '''
+    Return the list of headers for all files in the archive, see headers(). The headers are read
+    natively in a single call, which is faster than headers() when all of them are needed.
+    '''
+    c = Callback(pw=password, volume_resolver=volume_resolver)
+    archive_path = type('')(archive_path)
+    with open_archive(archive_path, c, mode) as f:
+        if member_filter is not None:
+            member_filter.apply(f)
+        if normalize_names:
+            unrar.set_name_options(f, unrar.NAMES_NORMALIZE)
+        return do_func(unrar.read_all_headers, archive_path, f, c)
+
+
+def read_archive(archive_path, password=None, mode=unrar.RAR_OM_LIST, volume_resolver=None):
+    '''
+    Return the archive level information (see unrar.archive_info()) and the
+    list of headers for all files in the archive, using a single open.
+    '''
+    c = Callback(pw=password, volume_resolver=volume_resolver)
+    archive_path = type('')(archive_path)
+    with open_archive(archive_path, c, mode) as f:
+        all_headers = do_func(unrar.read_all_headers, archive_path, f, c)
+        return unrar.archive_info(f), all_headers
+
+
+class HeaderTable(object):
+    '''
+    Columnar header data for all files in an archive. Indexing gives a
+    memoryview for the specified column, one of: pack_size, unpack_size,
+    file_crc, file_time, flags, file_attr, method, redir_type and volume, which can be
+    used with numpy.frombuffer() and the like without copying. The file names
+    are stored UTF-8 encoded in names_blob with file i at
+    names_blob[name_offsets[i]:name_offsets[i+1]]. If the directories were
+    interned, names_blob has only the part of each name after its directory,
+    which is dirs[table['dir'][i]].
+    '''
+
+    def __init__(self, columns, names_blob, name_offsets, dirs=None):
+        self.columns, self.names_blob, self.name_offsets, self.dirs = columns, names_blob, name_offsets, dirs
+
+    def __len__(self):
+        return len(self.name_offsets) - 1
+
+    def __getitem__(self, column):
+        return self.columns[column]
+
+    def name(self, i):
+        ans = self.names_blob[self.name_offsets[i]:self.name_offsets[i+1]].decode('utf-8')
+        if self.dirs is not None:
+            ans = self.dirs[self.columns['dir'][i]] + ans
+        return ans
+
+    def names(self):
+        for i in range(len(self)):
+            yield self.name(i)
+
+
+def header_table(archive_path, password=None, mode=unrar.RAR_OM_LIST, member_filter=None, normalize_names=False, intern_dirs=False):
+    '''
+    Return a HeaderTable for all files in the archive, or only those selected by member_filter.
+    With normalize_names the names use / as the separator on all platforms. intern_dirs stores
+    every distinct directory only once, which saves memory for archives with deep directory trees.
+    '''
+    c = Callback(pw=password)
+    archive_path = type('')(archive_path)
+    with open_archive(archive_path, c, mode) as f:
+        if member_filter is not None:
+            member_filter.apply(f)
+        unrar.set_name_options(f, (unrar.NAMES_NORMALIZE if normalize_names else 0) | (unrar.NAMES_INTERN if intern_dirs else 0))
+        return HeaderTable(*do_func(unrar.read_header_table, archive_path, f, c))
+
+
+def names(archive_path, only_useful=False, password=None, member_filter=None):
+    ''' Yield the archive file names for all files in the archive, or only those selected by member_filter '''
+    for h in headers(archive_path, password=password, member_filter=member_filter, normalize_names=True):
         if not only_useful or is_useful(h):
-            yield h['filename'].replace(os.sep, '/')
+            yield h['filename']
 
 
 def comment(archive_path):
@@ -197,11 +384,29 @@ def comment(archive_path):
         return x[1].decode('utf-8')
 
 
+def probe(archive_path):
+    '''
+    Cheaply check whether the file is a RAR archive and read its archive level
+    flags, without listing it. Returns a ProbeResult with fields such as
+    is_rar, is_volume, is_first_volume, is_solid and encrypted.
+    '''
+    return unrar.probe(type('')(archive_path))
+
+
+def try_passwords(archive_path, candidates, threads=1):
+    '''
+    Return the first of the candidate passwords that is correct for the
+    archive, or None. The candidates are tested natively, using the specified
+    number of threads. Raises ValueError if the archive is not encrypted.
+    '''
+    return unrar.try_passwords(type('')(archive_path), [type('')(x) for x in candidates], threads)
+
+
 class ExtractCallback(Callback):
 
-    def __init__(self, pw=None, verify_data=False):
+    def __init__(self, pw=None, verify_data=False, volume_resolver=None):
         self.verify_data = verify_data
-        Callback.__init__(self, pw=pw)
+        Callback.__init__(self, pw=pw, volume_resolver=volume_resolver)
         self.crc = 0
 
     def _process_data(self, data):
@@ -222,10 +427,10 @@ class FileCorrupt(ValueError):
     pass
 
 
-def verify(archive_path, crc_map, password=None):
+def verify(archive_path, crc_map, password=None, volume_resolver=None):
     # Verify CRCs
     crcs = {}
-    for h in headers(archive_path, password=password, mode=unrar.RAR_OM_LIST_INCSPLIT):
+    for h in headers(archive_path, password=password, mode=unrar.RAR_OM_LIST_INCSPLIT, volume_resolver=volume_resolver):
         crcs[h['filename']] = h['file_crc']
     for k in crc_map:
         got = crc_map[k] & 0xffffffff
@@ -235,101 +440,833 @@ def verify(archive_path, crc_map, password=None):
                 k, nominal, got))
 
 
-def _extract(f, archive_path, c, location):
-    seen = set()
+class Destination(object):
+    '''
+    Maps file names from an archive to paths below location for the duration
+    of a single extraction. The directory part of every name is validated and
+    created only once, which matters for archives with many small files.
+    '''
+
+    def __init__(self, location):
+        self.base = os.path.abspath(location)
+        self.nbase = os.path.normcase(self.base)
+        self.dirs = {}
+        self.created = set()
+        self.seen = set()
+
+    def safe_dir(self, dirname):
+        try:
+            return self.dirs[dirname]
+        except KeyError:
+            pass
+        path = os.path.abspath(os.path.join(self.base, dirname))
+        npath = os.path.normcase(path)
+        if npath != self.nbase and not (npath.startswith(self.nbase) and npath[len(self.nbase)] in (os.sep, '/')):
+            path = None
+        self.dirs[dirname] = path
+        return path
+
+    def path(self, filename):
+        dirname, name = os.path.split(filename)
+        if name in ('', '.', '..'):
+            return safe_path(self.base, filename)
+        parent = self.safe_dir(dirname)
+        return None if parent is None else os.path.join(parent, name)
+
+    def ensure_dir(self, path):
+        if path not in self.created:
+            ensure_dir(path)
+            self.created.add(path)
+
+
+def _extract_one(f, archive_path, c, location, h, crc_map, dests):
+    filename = h['filename']
+    if not filename:
+        return
+    open_file = None
+    dest = dests.path(filename)
+    c.reset(crc=crc_map[filename])
+    extracted = False
+    if h['is_dir']:
+        try:
+            if dest not in dests.created:
+                os.makedirs(dest)
+                dests.created.add(dest)
+        except Exception:
+            pass
+            # We ignore create directory errors since we dont
+            # care about missing empty dirs
+        crc_map.pop(filename)
+    elif h['redir_type'] != 0:
+        if h['redir_type'] == 1:  # Unix symlink
+            syn = h.get('redir_name')
+            if syn and not iswindows:
+                # Only RAR 5 archives have a redir_name
+                syn_base = os.path.dirname(dest)
+                if is_safe_symlink(location, os.path.join(syn_base, syn)):
+                    dests.ensure_dir(syn_base)
+                    os.symlink(syn, dest)
+        crc_map.pop(filename)
+    else:
+        dests.ensure_dir(os.path.dirname(dest))
+        open_file = local_open(make_long_path_useable(dest), 'ab' if dest in dests.seen else 'wb')
+        c.reset(write=open_file.write, crc=crc_map[filename])
+        extracted = True
+    try:
+        if open_file is not None:
+            crc = do_func(
+                unrar.process_file, archive_path, f, c, unrar.RAR_TEST, open_file.fileno(), False,
+                crc_map[filename] if c.verify_data else None, h['unpack_size'] if h['unpack_size'] < unknown_unpack_size else -1)
+            if crc is not None:
+                c.crc = crc
+        else:
+            do_func(unrar.process_file, archive_path, f, c)
+    finally:
+        if open_file is not None:
+            open_file.close()
+    dests.seen.add(dest)
+    if extracted:
+        crc_map[filename] = c.crc
+        c.reset()  # so that file is closed
+        os.utime(dest, (h['file_time'], h['file_time']))
+
+
+# Size of the writes used when extracting to files
+write_buffer_size = 1024 * 1024
+# Size of the chunks of data passed to python callbacks, small chunks
+# produced by unrar are gathered natively until there is this much data
+callback_buffer_size = 1024 * 1024
+# unrar reports files whose size is not stored in the archive as having a
+# huge size
+unknown_unpack_size = 1 << 62
+# The largest size from a header that extract_member() allocates up front, a
+# corrupt header can claim any size, larger members are gathered in chunks
+max_preallocated_member = 256 * 1024 * 1024
+
+
+def output_flags(direct_io=False, drop_cache=False, write_behind=True):
+    return (
+        (unrar.OUTPUT_DIRECT if direct_io else 0) | (unrar.OUTPUT_DROP_CACHE if drop_cache else 0) |
+        (unrar.OUTPUT_WRITE_BEHIND if write_behind else 0))
+
+
+def _extract(f, archive_path, c, location, flags=0):
+    unrar.set_output_options(f, write_buffer_size, flags)
+    dests = Destination(location)
     crc_map = defaultdict(lambda: 0)
     while True:
         h = do_func(unrar.read_next_header, archive_path, f, c)
         if h is None:
             break
-        filename = h['filename']
-        if not filename:
-            continue
-        open_file = None
-        dest = safe_path(location, filename)
-        c.reset(crc=crc_map[filename])
-        extracted = False
-        if h['is_dir']:
-            try:
-                os.makedirs(safe_path(location, filename))
-            except Exception:
-                pass
-                # We ignore create directory errors since we dont
-                # care about missing empty dirs
-            crc_map.pop(filename)
-        elif h['redir_type'] != 0:
-            if h['redir_type'] == 1:  # Unix symlink
-                syn = h.get('redir_name')
-                if syn and not iswindows:
-                    # Only RAR 5 archives have a redir_name
-                    syn_base = os.path.dirname(dest)
-                    if is_safe_symlink(location, os.path.join(syn_base, syn)):
-                        ensure_dir(syn_base)
-                        os.symlink(syn, dest)
-            crc_map.pop(filename)
-        else:
-            ensure_dir(os.path.dirname(dest))
-            open_file = local_open(make_long_path_useable(dest), 'ab' if dest in seen else 'wb')
-            c.reset(write=open_file.write, crc=crc_map[filename])
-            extracted = True
-        try:
-            if open_file is not None and not c.verify_data:
-                do_func(unrar.process_file, archive_path, f, c, unrar.RAR_TEST, open_file.fileno())
-            else:
-                do_func(unrar.process_file, archive_path, f, c)
-        finally:
-            if open_file is not None:
-                open_file.close()
-        seen.add(dest)
-        if extracted:
-            crc_map[filename] = c.crc
-            c.reset()  # so that file is closed
-            os.utime(dest, (h['file_time'], h['file_time']))
+        _extract_one(f, archive_path, c, location, h, crc_map, dests)
     return crc_map
 
 
-def extract(archive_path, location='.', password=None, verify_data=False):
-    ''' Extract all files from the archive to the specified location, which must be an existing directory. '''
-    c = ExtractCallback(pw=password, verify_data=verify_data)
+# Parallel extraction {{{
+# Fixed cost of extracting a file, in bytes, used when balancing work between threads
+per_file_cost = 64 * 1024
+
+
+def plan_chunks(all_headers, num_of_chunks):
+    '''
+    Group the files into contiguous ranges (start, end) of roughly equal
+    weight, based on unpack_size. A file larger than the target weight gets a
+    range of its own. The ranges are returned heaviest first.
+    '''
+    weights = [h['unpack_size'] + per_file_cost for h in all_headers]
+    target = max(1, sum(weights) // max(1, num_of_chunks))
+    chunks, current = [], 0
+    for i, w in enumerate(weights):
+        if current and current + w > target:
+            chunks.append([current, chunk_start, i])
+            current = 0
+        if not current:
+            chunk_start = i
+        current += w
+    if current:
+        chunks.append([current, chunk_start, len(weights)])
+    chunks.sort(key=lambda x: (-x[0], x[1]))
+    return [(start, end) for w, start, end in chunks]
+
+
+def _extract_parallel(
+    archive_path, location, password, verify_data, threads, chunks, all_headers, flags=0, volume_resolver=None
+):
+    lock = threading.Lock()
+    chunks = list(reversed(chunks))
+    errors, crc_maps = [], []
+
+    def next_chunk():
+        with lock:
+            if not errors and chunks:
+                return chunks.pop()
+
+    def extract_range(f, c, start, end, crc_map, dests):
+        unrar.set_output_options(f, write_buffer_size, flags)
+        for i in range(start, end):
+            h = do_func(unrar.read_next_header, archive_path, f, c)
+            if h is None or h['filename'] != all_headers[i]['filename']:
+                raise ValueError('The archive changed while being extracted: %r' % archive_path)
+            _extract_one(f, archive_path, c, location, h, crc_map, dests)
+
+    def worker():
+        c = ExtractCallback(pw=password, verify_data=verify_data, volume_resolver=volume_resolver)
+        crc_map, dests = defaultdict(lambda: 0), Destination(location)
+        try:
+            # Every range gets its own handle, so that ranges can be taken in
+            # any order, skipping to the start of a range is cheap in
+            # non-solid archives
+            for start, end in iter(next_chunk, None):
+                with open_archive(archive_path, c, unrar.RAR_OM_EXTRACT) as f:
+                    do_func(unrar.skip_headers, archive_path, f, c, start)
+                    extract_range(f, c, start, end, crc_map, dests)
+        except BaseException as e:
+            with lock:
+                errors.append(e)
+        crc_maps.append(crc_map)
+
+    workers = [threading.Thread(target=worker, name='unrar-%d' % i) for i in range(min(threads, len(chunks)))]
+    for w in workers:
+        w.daemon = True
+        w.start()
+    for w in workers:
+        w.join()
+    if errors:
+        raise errors[0]
+    ans = {}
+    for crc_map in crc_maps:
+        ans.update(crc_map)
+    return ans
+
+
+def can_extract_in_parallel(all_headers):
+    names = set()
+    for h in all_headers:
+        if h['filename'] in names:
+            # duplicate file names must be extracted in order
+            return False
+        names.add(h['filename'])
+    return True
+# }}}
+
+
+def extract(
+    archive_path, location='.', password=None, verify_data=False, threads=1, direct_io=False, drop_cache=False, write_behind=True,
+    volume_resolver=None, member_filter=None
+):
+    '''
+    Extract all files from the archive to the specified location, which must be an existing directory.
+    member_filter is a MemberFilter selecting the files to extract, with a filter a single thread is used.
+    If threads > 1 the files are extracted using that many threads. Solid archives are always
+    extracted serially, as skipping to a file in a solid archive means decompressing everything before it.
+    direct_io and drop_cache avoid filling the page cache with the extracted data, using direct I/O
+    and by dropping the data from the cache after each file is written, respectively. write_behind
+    writes to disk from a separate thread, overlapping decompression and I/O. volume_resolver is a
+    VolumeResolver used to locate the volumes of multi-volume archives that are not available locally.
+    '''
     archive_path = type('')(archive_path)
+    flags = output_flags(direct_io, drop_cache, write_behind)
+    if threads > 1 and member_filter is None:
+        all_headers = ()
+        c = Callback(pw=password, volume_resolver=volume_resolver)
+        with open_archive(archive_path, c) as f:
+            # Every worker would have to decompress all the files before the
+            # ones it extracts, costing threads times the CPU for no gain, so
+            # the headers of solid archives are not even listed
+            if not unrar.archive_info(f)['is_solid']:
+                all_headers = do_func(unrar.read_all_headers, archive_path, f, c)
+        del f
+        if len(all_headers) > 1 and can_extract_in_parallel(all_headers):
+            chunks = plan_chunks(all_headers, 4 * threads)
+            crc_map = _extract_parallel(
+                archive_path, location, password, verify_data, threads, chunks, all_headers, flags=flags,
+                volume_resolver=volume_resolver)
+            if verify_data:
+                verify(archive_path, crc_map, password=password, volume_resolver=volume_resolver)
+            return
+    c = ExtractCallback(pw=password, verify_data=verify_data, volume_resolver=volume_resolver)
     with open_archive(archive_path, c, unrar.RAR_OM_EXTRACT) as f:
-        crc_map = _extract(f, archive_path, c, location)
+        if member_filter is not None:
+            member_filter.apply(f)
+        if hasattr(unrar, 'extract_all'):
+            unrar.set_output_options(f, write_buffer_size, flags)
+            crc_map = do_func(unrar.extract_all, archive_path, f, c, location)
+        else:
+            crc_map = _extract(f, archive_path, c, location, flags)
     del f
     if verify_data:
-        verify(archive_path, crc_map, password=password)
+        verify(archive_path, crc_map, password=password, volume_resolver=volume_resolver)
+
+
+# Batch extraction {{{
+BatchResult = namedtuple('BatchResult', 'job_id archive_path location error')
+
+
+class BatchExtractor(object):
+    '''
+    Extract many archives using a fixed pool of threads in a single process.
+    Jobs are added with submit(), which blocks while max_pending jobs are
+    waiting to be started, so producers cannot run arbitrarily far ahead of
+    the workers. Errors are isolated per archive: a failing job stores its
+    exception in the error field of its BatchResult and the other jobs are
+    unaffected. Use results() to get results as jobs finish, or join() to
+    wait for all of them. When used as a context manager join() is called
+    on exit. Any keyword arguments are passed to extract() for every job.
+    '''
+
+    def __init__(self, threads=4, max_pending=None, **extract_kwargs):
+        self.extract_kwargs = extract_kwargs
+        self.max_pending = max(1, max_pending or 2 * threads)
+        self.cond = threading.Condition()
+        self.pending, self.finished = deque(), deque()
+        self.all_results = {}
+        self.next_job_id = 0
+        self.closed = False
+        self.workers = [threading.Thread(target=self.run, name='unrar-batch-%d' % i) for i in range(max(1, threads))]
+        for w in self.workers:
+            w.daemon = True
+            w.start()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *a):
+        self.join()
+
+    def submit(self, archive_path, location='.', timeout=None, **extract_kwargs):
+        '''
+        Queue the archive for extraction to location, returning the job id.
+        Blocks while the queue is full. If timeout is not None and the queue
+        is still full after timeout seconds, returns None without queueing the
+        job. The keyword arguments override the ones given to the constructor.
+        '''
+        kw = dict(self.extract_kwargs)
+        kw.update(extract_kwargs)
+        with self.cond:
+            if self.closed:
+                raise RuntimeError('Cannot submit jobs to a BatchExtractor after join()')
+            end = None if timeout is None else time.time() + timeout
+            while len(self.pending) >= self.max_pending:
+                left = None if end is None else end - time.time()
+                if left is not None and left <= 0:
+                    return None
+                self.cond.wait(left)
+                if self.closed:
+                    raise RuntimeError('Cannot submit jobs to a BatchExtractor after join()')
+            job_id = self.next_job_id
+            self.next_job_id += 1
+            self.pending.append((job_id, archive_path, location, kw))
+            self.cond.notify_all()
+        return job_id
+
+    def run(self):
+        while True:
+            with self.cond:
+                while not self.pending and not self.closed:
+                    self.cond.wait()
+                if not self.pending:
+                    return
+                job_id, archive_path, location, kw = self.pending.popleft()
+                self.cond.notify_all()
+            error = None
+            try:
+                extract(archive_path, location, **kw)
+            except Exception as e:
+                error = e
+            result = BatchResult(job_id, archive_path, location, error)
+            with self.cond:
+                self.all_results[job_id] = result
+                self.finished.append(result)
+                self.cond.notify_all()
+
+    @property
+    def outstanding(self):
+        ' The number of jobs that have been submitted but not yet finished '
+        with self.cond:
+            return self.next_job_id - len(self.all_results)
+
+    def results(self):
+        '''
+        Yield a BatchResult for every job as it finishes, in order of
+        completion. Stops once all jobs submitted so far have finished
+        and their results have been yielded.
+        '''
+        while True:
+            with self.cond:
+                while not self.finished and self.next_job_id > len(self.all_results):
+                    self.cond.wait()
+                if not self.finished:
+                    return
+                result = self.finished.popleft()
+            yield result
+
+    def join(self):
+        '''
+        Wait for all jobs to finish and stop the worker threads. Returns the
+        results of all jobs in the order they were submitted. No more jobs
+        can be submitted afterwards.
+        '''
+        with self.cond:
+            self.closed = True
+            self.cond.notify_all()
+        for w in self.workers:
+            w.join()
+        self.finished.clear()
+        return [self.all_results[i] for i in sorted(self.all_results)]
+# }}}
+
+
+# Archive index {{{
+# Directory in which archive indices are persisted, if None they are only
+# cached in memory
+index_cache_dir = os.environ.get('UNRARDLL_INDEX_CACHE_DIR') or None
+# The most recently used indices, at most index_memory_cache_size of them
+index_memory_cache = OrderedDict()
+index_memory_cache_size = 64
+index_memory_cache_lock = threading.Lock()
+
+
+class ArchiveIndex(object):
+    '''
+    The headers of all files in an archive, in archive order, along with the
+    archive level information from unrar.archive_info() and the size and
+    modification time of the archive when they were read. Every header gets
+    the key index, its position in the archive. Since the unrar dll has no
+    seek API, extracting a member means skipping index files natively, from
+    the start of the archive, which for solid archives involves decompressing
+    them.
+    '''
+
+    version = 5
+
+    def __init__(self, archive_path, size, mtime, info, headers):
+        self.archive_path, self.size, self.mtime, self.info, self.headers = archive_path, size, mtime, info, headers
+        for i, h in enumerate(headers):
+            h['index'] = i
+
+    def matches(self, st):
+        return self.size == st.st_size and self.mtime == st.st_mtime_ns
+
+    def find(self, predicate):
+        for h in self.headers:
+            if is_useful(h) and predicate(h):
+                return h
+
+    @staticmethod
+    def cache_path(archive_path):
+        return os.path.join(index_cache_dir, sha1(archive_path.encode('utf-8')).hexdigest() + '.json')
+
+    @classmethod
+    def load(cls, archive_path, st):
+        if not index_cache_dir:
+            return
+        try:
+            with open(cls.cache_path(archive_path), 'rb') as f:
+                d = json.loads(f.read().decode('utf-8'))
+        except (EnvironmentError, ValueError):
+            return
+        if d.get('version') == cls.version and d.get('archive_path') == archive_path:
+            ans = cls(archive_path, d['size'], d['mtime'], d['info'], d['headers'])
+            if ans.matches(st):
+                return ans
+
+    def save(self):
+        # The names in archives with encrypted headers must not end up on disk in plaintext
+        if not index_cache_dir or self.info.get('encrypted_headers'):
+            return
+        ensure_dir(index_cache_dir)
+        path = self.cache_path(self.archive_path)
+        raw = json.dumps({
+            'version': self.version, 'archive_path': self.archive_path, 'size': self.size, 'mtime': self.mtime,
+            'info': self.info, 'headers': self.headers}, ensure_ascii=False).encode('utf-8')
+        atomic_write(path, raw)
+
+
+def archive_index(archive_path, password=None, volume_resolver=None):
+    '''
+    Return the ArchiveIndex for the specified archive, re-using a cached index
+    if the archive has not changed since the index was created. Only the
+    first volume is checked for changes in multi-volume archives.
+    volume_resolver is used to locate the other volumes, see VolumeResolver.
+    '''
+    archive_path = os.path.abspath(type('')(archive_path))
+    st = os.stat(archive_path)
+    with index_memory_cache_lock:
+        ans = index_memory_cache.get(archive_path)
+        if ans is not None:
+            index_memory_cache.move_to_end(archive_path)
+    if ans is None or not ans.matches(st):
+        ans = ArchiveIndex.load(archive_path, st)
+        if ans is None:
+            info, all_headers = read_archive(archive_path, password=password, volume_resolver=volume_resolver)
+            ans = ArchiveIndex(archive_path, st.st_size, st.st_mtime_ns, info, all_headers)
+            ans.save()
+        with index_memory_cache_lock:
+            index_memory_cache[archive_path] = ans
+            while len(index_memory_cache) > index_memory_cache_size:
+                index_memory_cache.popitem(last=False)
+    return ans
+# }}}
+
+
+# Resumable extraction {{{
+class ExtractJournal(object):
+    '''
+    A sidecar file recording the members of an archive that have been
+    extracted, so that an interrupted extraction can be resumed. Members are
+    extracted in archive order, so the journal is always a prefix of the
+    archive. Every line is a JSON object, the first identifies the archive and
+    the destination, the others have the name and CRC of a completed member.
+    Lines are flushed as they are written, so the journal survives the process
+    being killed, though not the loss of unsynced data.
+    '''
+
+    version = 1
+
+    def __init__(self, path, identity):
+        self.path, self.identity = path, identity
+        self.completed = []
+        self.f = None
+        try:
+            with open(path, 'rb') as f:
+                lines = f.read().decode('utf-8', 'replace').splitlines()
+        except EnvironmentError:
+            return
+        try:
+            if not lines or json.loads(lines[0]) != identity:
+                return
+        except ValueError:
+            return
+        for line in lines[1:]:
+            try:
+                x = json.loads(line)
+                self.completed.append((x['name'], x['crc']))
+            except (ValueError, KeyError, TypeError):
+                break  # the last line was only partially written
+
+    def start(self, count):
+        ' Keep the first count completed members and append new ones after them '
+        del self.completed[count:]
+        entries = [self.identity] + [{'name': name, 'crc': crc} for name, crc in self.completed]
+        raw = ''.join(json.dumps(x, ensure_ascii=False) + '\n' for x in entries).encode('utf-8')
+        atomic_write(self.path, raw)
+        self.f = open(self.path, 'ab')
 
+    def record(self, name, crc):
+        self.f.write((json.dumps({'name': name, 'crc': crc}, ensure_ascii=False) + '\n').encode('utf-8'))
+        self.f.flush()
+        self.completed.append((name, crc))
 
-def extract_member(archive_path, predicate, password=None, verify_data=False):
-    ''' Extract a single file from the archive for which the predicate function returns true. Return (file name, data as bytes). '''
-    c = ExtractCallback(pw=password, verify_data=verify_data)
+    def close(self):
+        if self.f is not None:
+            self.f.close()
+            self.f = None
+
+    def remove(self):
+        self.close()
+        try:
+            os.remove(self.path)
+        except EnvironmentError:
+            pass
+
+
+def resume_point(journal, archive_path, location, password=None, volume_resolver=None):
+    '''
+    Return how many of the members in the journal are still extracted. The
+    names are checked against the archive index, which is usually cached, and
+    the sizes against the files on disk, a member whose file is missing or
+    has the wrong size is extracted again, along with all members after it.
+    '''
+    if not journal.completed:
+        return 0
+    dests = Destination(location)
+    ans = 0
+    for (name, crc), h in zip(journal.completed, archive_index(archive_path, password=password, volume_resolver=volume_resolver).headers):
+        if name != h['filename']:
+            break
+        if is_useful(h) and h['unpack_size'] < unknown_unpack_size:
+            path = dests.path(name)
+            try:
+                if path is not None and os.path.getsize(make_long_path_useable(path)) != h['unpack_size']:
+                    break
+            except EnvironmentError:
+                break
+        ans += 1
+    return ans
+
+
+def extract_resumable(
+    archive_path, location='.', journal_path=None, password=None, verify_data=False, direct_io=False, drop_cache=False,
+    write_behind=True, volume_resolver=None
+):
+    '''
+    Extract all files from the archive to location, like extract() with one
+    thread, recording progress in an ExtractJournal at journal_path, by default
+    .unrardll-journal in location. If the extraction is interrupted, calling
+    this function again resumes it after the last completed member, which is
+    skipped to natively. The unrar dll has no seek API, in non-solid archives
+    skipping only reads the headers, in solid archives the skipped members
+    have to be decompressed, but are not written. The journal is removed once
+    the extraction succeeds. With verify_data the CRCs of members extracted by
+    earlier runs are taken from the journal, so a journal is only resumed with
+    the same verify_data.
+    '''
+    archive_path = os.path.abspath(type('')(archive_path))
+    location = os.path.abspath(type('')(location))
+    st = os.stat(archive_path)
+    journal = ExtractJournal(journal_path or os.path.join(location, '.unrardll-journal'), {
+        'version': ExtractJournal.version, 'archive_path': archive_path, 'size': st.st_size, 'mtime': st.st_mtime_ns,
+        'location': location, 'verify_data': bool(verify_data)})
+    journal.start(resume_point(journal, archive_path, location, password=password, volume_resolver=volume_resolver))
+    crc_map = defaultdict(lambda: 0)
+    dests = Destination(location)
+    for name, crc in journal.completed:
+        dests.seen.add(dests.path(name))
+        if crc is not None:
+            crc_map[name] = crc
+    c = ExtractCallback(pw=password, verify_data=verify_data, volume_resolver=volume_resolver)
+    try:
+        with open_archive(archive_path, c, unrar.RAR_OM_EXTRACT) as f:
+            unrar.set_output_options(f, write_buffer_size, output_flags(direct_io, drop_cache, write_behind))
+            if journal.completed:
+                do_func(unrar.skip_headers, archive_path, f, c, len(journal.completed))
+            while True:
+                h = do_func(unrar.read_next_header, archive_path, f, c)
+                if h is None:
+                    break
+                _extract_one(f, archive_path, c, location, h, crc_map, dests)
+                journal.record(h['filename'], crc_map.get(h['filename']) if verify_data else None)
+        del f
+    finally:
+        journal.close()
+    if verify_data:
+        try:
+            verify(archive_path, crc_map, password=password, volume_resolver=volume_resolver)
+        except FileCorrupt:
+            # Resuming would skip the corrupt files
+            journal.remove()
+            raise
+    journal.remove()
+# }}}
+
+
+def extract_member(archive_path, predicate, password=None, verify_data=False, use_index=False, member_filter=None):
+    '''
+    Extract a single file from the archive for which the predicate function returns true. Return (file name, data as bytes).
+    If use_index is True, the predicate is run against the headers from archive_index() and the archive
+    is skipped natively to the matching file. If member_filter is specified, only the files it selects are
+    considered, and predicate can be None.
+    '''
+    c = ExtractCallback(pw=password)
     archive_path = type('')(archive_path)
+    predicate = predicate or (lambda h: True)
+    skip = 0
+    if use_index:
+        h = archive_index(archive_path, password=password).find(predicate)
+        if h is None:
+            return None, None
+        skip = h['index']
     with open_archive(archive_path, c, unrar.RAR_OM_EXTRACT) as f:
+        if skip:
+            do_func(unrar.skip_headers, archive_path, f, c, skip)
+        if member_filter is not None:
+            member_filter.apply(f)
         while True:
             h = do_func(unrar.read_next_header, archive_path, f, c)
             if h is None:
                 return None, None
             if h['is_dir'] or h['redir_type'] or not predicate(h):
                 do_func(unrar.process_file, archive_path, f, c, unrar.RAR_SKIP)
+            elif h['unpack_size'] <= max_preallocated_member:
+                # Decompress straight into a bytes object of the right size
+                buf = unrar.set_output_bytes(f, h['unpack_size'])
+                crc = do_func(unrar.process_file, archive_path, f, c, unrar.RAR_TEST, -1, False, 0 if verify_data else None)
+                if unrar.set_output_buffer(f) != len(buf):
+                    raise FileCorrupt('The size of %r does not match' % h['filename'])
+                break
             else:
+                # The size is unknown or too large to trust, so only memory for
+                # the data actually in the archive is used
                 buf = []
                 c.reset(write=buf.append)
-                do_func(unrar.process_file, archive_path, f, c)
+                crc = do_func(unrar.process_file, archive_path, f, c, unrar.RAR_TEST, -1, False, 0 if verify_data else None)
+                buf = b''.join(buf)
+                if h['unpack_size'] < unknown_unpack_size and len(buf) != h['unpack_size']:
+                    raise FileCorrupt('The size of %r does not match' % h['filename'])
                 break
     del f
-    crc_map = {h['filename']: c.crc}
+    crc_map = {h['filename']: crc or 0}
     if verify_data:
         verify(archive_path, crc_map, password=password)
-    return h['filename'], b''.join(buf)
+    return h['filename'], buf
+
+
+# Streaming {{{
+class RingBuffer(object):
+    ''' A bounded buffer for passing data from the unrar thread to a reader '''
+
+    def __init__(self, capacity):
+        self.buf = bytearray(capacity)
+        self.capacity, self.start, self.size = capacity, 0, 0
+        self.cond = threading.Condition()
+        self.finished = self.closed = False
+        self.error = None
+
+    def write(self, data):
+        ' Blocks until all of data is in the buffer, returns False if the reader was closed '
+        data = memoryview(data)
+        while len(data):
+            with self.cond:
+                while self.size == self.capacity and not self.closed:
+                    self.cond.wait()
+                if self.closed:
+                    return False
+                n = min(len(data), self.capacity - self.size)
+                end = (self.start + self.size) % self.capacity
+                first = min(n, self.capacity - end)
+                self.buf[end:end + first] = data[:first]
+                self.buf[:n - first] = data[first:n]
+                self.size += n
+                self.cond.notify_all()
+            data = data[n:]
+        return True
+
+    def readinto(self, b):
+        with self.cond:
+            while not self.size and not self.finished:
+                self.cond.wait()
+            if not self.size:
+                if self.error is not None:
+                    raise self.error
+                return 0
+            n = min(len(b), self.size)
+            first = min(n, self.capacity - self.start)
+            b[:first] = self.buf[self.start:self.start + first]
+            b[first:n] = self.buf[:n - first]
+            self.start = (self.start + n) % self.capacity
+            self.size -= n
+            self.cond.notify_all()
+            return n
+
+    def finish(self, error=None):
+        with self.cond:
+            self.finished, self.error = True, error
+            self.cond.notify_all()
+
+    def close(self):
+        with self.cond:
+            self.closed = True
+            self.cond.notify_all()
+
+
+class StreamCallback(Callback):
+
+    def __init__(self, pw, ring):
+        Callback.__init__(self, pw=pw)
+        self.ring = ring
+
+    def _process_data(self, data):
+        return self.ring.write(data)
+
+
+class MemberReader(io.RawIOBase):
+    '''
+    A read-only file like object for a single member of an archive. The
+    member is decompressed by a separate thread into a bounded buffer, so
+    memory use does not depend on the size of the member.
+    '''
+
+    def __init__(self, archive_path, predicate, password=None, verify_data=False, buffer_size=4 * 1024 * 1024):
+        io.RawIOBase.__init__(self)
+        self.archive_path, self.predicate, self.password, self.verify_data = archive_path, predicate, password, verify_data
+        self.ring = RingBuffer(buffer_size)
+        self.header = None
+        self.header_found = threading.Event()
+        self.thread = threading.Thread(target=self.run, name='unrar-stream')
+        self.thread.daemon = True
+        self.thread.start()
+        self.header_found.wait()
+
+    def run(self):
+        error = None
+        c = StreamCallback(self.password, self.ring)
+        try:
+            with open_archive(self.archive_path, c, unrar.RAR_OM_EXTRACT) as f:
+                # Keep the chunks small relative to the ring buffer, so the
+                # reader is not starved while a chunk is being gathered
+                unrar.set_callback_buffer(f, min(callback_buffer_size, self.ring.capacity // 4))
+                while True:
+                    h = do_func(unrar.read_next_header, self.archive_path, f, c)
+                    if h is None:
+                        break
+                    if h['is_dir'] or h['redir_type'] or not self.predicate(h):
+                        do_func(unrar.process_file, self.archive_path, f, c, unrar.RAR_SKIP)
+                        continue
+                    self.header = h
+                    self.header_found.set()
+                    try:
+                        crc = do_func(
+                            unrar.process_file, self.archive_path, f, c, unrar.RAR_TEST, -1, True, 0 if self.verify_data else None)
+                    except unrar.UNRARError:
+                        if self.ring.closed:
+                            break
+                        raise
+                    if self.verify_data and crc != h['file_crc'] & 0xffffffff:
+                        raise FileCorrupt('The CRC for %r does not match. Expected: %d Got %d' % (
+                            h['filename'], h['file_crc'] & 0xffffffff, crc))
+                    break
+        except Exception as e:
+            error = e
+        finally:
+            self.header_found.set()
+            self.ring.finish(error)
+
+    @property
+    def name(self):
+        return self.header['filename']
+
+    def readable(self):
+        return True
+
+    def readinto(self, b):
+        return self.ring.readinto(memoryview(b).cast('B'))
+
+    def close(self):
+        if not self.closed:
+            self.ring.close()
+            self.thread.join()
+        io.RawIOBase.close(self)
+
+
+def open_member(archive_path, predicate, password=None, verify_data=False, buffer_size=4 * 1024 * 1024):
+    '''
+    Return a read-only file like object (see MemberReader) for the first file in the archive for which the
+    predicate function returns True or None if there is no such file. The header of the file is available
+    as the header attribute.
+    '''
+    ans = MemberReader(type('')(archive_path), predicate, password=password, verify_data=verify_data, buffer_size=buffer_size)
+    if ans.header is None:
+        try:
+            ans.read(1)  # raise any error that happened while looking for the file
+        finally:
+            ans.close()
+        return None
+    return ans
+# }}}
 
 
-def extract_members(archive_path, callback, password=None, verify_data=False):
+def extract_members(archive_path, callback, password=None, verify_data=False, member_filter=None):
     '''
     Extract multiple members calling callback, with header and data and optionally verification.
-    Only members for which callback returns True when called with the header are extracted.
+    Only members for which callback returns True when called with the header are extracted. If
+    member_filter is specified, callback is only called for the members it selects.
     '''
-    c = ExtractCallback(pw=password, verify_data=verify_data)
+    c = ExtractCallback(pw=password)
     archive_path = type('')(archive_path)
     with open_archive(archive_path, c, unrar.RAR_OM_EXTRACT) as f:
+        if member_filter is not None:
+            member_filter.apply(f)
+        unrar.set_callback_buffer(f, callback_buffer_size)
         while True:
             h = do_func(unrar.read_next_header, archive_path, f, c)
             if h is None:
@@ -338,6 +1275,6 @@ def extract_members(archive_path, callback, password=None, verify_data=False):
                 do_func(unrar.process_file, archive_path, f, c, unrar.RAR_SKIP)
             else:
                 c.reset(write=callback)
-                do_func(unrar.process_file, archive_path, f, c)
+                crc = do_func(unrar.process_file, archive_path, f, c, unrar.RAR_TEST, -1, False, 0 if verify_data else None)
                 if verify_data:
-                    callback(c.crc & 0xffffffff == h['file_crc'] & 0xffffffff)
+                    callback(crc == h['file_crc'] & 0xffffffff)
@@ -0,0 +1,250 @@
+#!/usr/bin/env python
+# vim:fileencoding=utf-8
+# License: BSD Copyright: 2017, Kovid Goyal <kovid at kovidgoyal.net>
+
+'''
+asyncio interface to unrardll.
+
+The short blocking unrar calls, opening, reading headers and closing, are run
+as jobs by a small pool of worker threads, shared by all event loops, so that
+thousands of concurrent listings do not need thousands of threads. The data of
+a member is streamed by a separate pool of threads, one per stream, which
+wait while their consumer is behind, so slow or interleaved streams never hold
+up the short jobs. At most default_max_streams members are streamed at once,
+further streams are queued until a thread is free. Results are
+handed to the event loop with call_soon_threadsafe(), which wakes it up
+through its self-pipe.
+'''
+
+from __future__ import absolute_import, division, print_function, unicode_literals
+
+import asyncio
+import os
+import threading
+from queue import Queue
+
+from . import Callback, FileCorrupt, do_func, open_handle, unrar
+
+default_chunk_size = 256 * 1024
+default_max_streams = 32
+
+
+def _resolve(fut, result, error):
+    if not fut.cancelled():
+        if error is None:
+            fut.set_result(result)
+        else:
+            fut.set_exception(error)
+
+
+class WorkerPool(object):
+    '''
+    A fixed number of threads running short blocking jobs on behalf of
+    coroutines, in the order they were submitted. Jobs must never wait for a
+    coroutine, as that could deadlock. The threads are started on first use.
+    '''
+
+    def __init__(self, threads=None, name='unrar-aio'):
+        self.num_threads = threads or min(8, os.cpu_count() or 4)
+        self.name = name
+        self.jobs = Queue()
+        self.threads = []
+        self.lock = threading.Lock()
+
+    def _start(self):
+        if len(self.threads) < self.num_threads:
+            with self.lock:
+                while len(self.threads) < self.num_threads:
+                    t = threading.Thread(target=self._worker, name='%s-%d' % (self.name, len(self.threads)))
+                    t.daemon = True
+                    t.start()
+                    self.threads.append(t)
+
+    def submit(self, func, *args):
+        ' Run func(*args) in a worker, ignoring its result '
+        self._start()
+        self.jobs.put((None, None, func, args))
+
+    def run(self, func, *args):
+        ' Return a future for the result of func(*args), run in a worker '
+        loop = asyncio.get_event_loop()
+        fut = loop.create_future()
+        self._start()
+        self.jobs.put((loop, fut, func, args))
+        return fut
+
+    def _worker(self):
+        while True:
+            loop, fut, func, args = self.jobs.get()
+            result = error = None
+            try:
+                result = func(*args)
+            except Exception as e:
+                error = e
+            if fut is not None:
+                try:
+                    loop.call_soon_threadsafe(_resolve, fut, result, error)
+                except RuntimeError:
+                    pass  # the event loop has been closed
+            del loop, fut, func, args, result, error
+
+
+_default_pool = _default_stream_pool = None
+_default_pool_lock = threading.Lock()
+
+
+def default_pool():
+    global _default_pool
+    with _default_pool_lock:
+        if _default_pool is None:
+            _default_pool = WorkerPool()
+        return _default_pool
+
+
+def default_stream_pool():
+    ' The pool used to stream the data of members, with default_max_streams threads '
+    global _default_stream_pool
+    with _default_pool_lock:
+        if _default_stream_pool is None:
+            _default_stream_pool = WorkerPool(default_max_streams, name='unrar-aio-stream')
+        return _default_stream_pool
+
+
+def _read_headers(archive_path, f, c, count):
+    ans = []
+    while len(ans) < count:
+        h = do_func(unrar.read_next_header, archive_path, f, c)
+        if h is None:
+            break
+        do_func(unrar.process_file, archive_path, f, c, unrar.RAR_SKIP)
+        ans.append(h)
+    return ans
+
+
+async def aheaders(archive_path, password=None, mode=unrar.RAR_OM_LIST, batch_size=64, pool=None, member_filter=None):
+    '''
+    Asynchronously yield the headers for all files in the archive, see
+    headers(). The headers are read by the worker pool batch_size at a time,
+    a worker is only used while a batch is being read.
+    '''
+    pool = pool or default_pool()
+    archive_path = type('')(archive_path)
+    c = Callback(pw=password)
+    f = await pool.run(open_handle, archive_path, c, mode)
+    try:
+        if member_filter is not None:
+            member_filter.apply(f)
+        while True:
+            batch = await pool.run(_read_headers, archive_path, f, c, batch_size)
+            for h in batch:
+                yield h
+            if len(batch) < batch_size:
+                break
+    finally:
+        # Closing waits for any job still using the handle, if this generator
+        # was cancelled, so it is done by the pool as well
+        pool.submit(unrar.close_archive, f)
+
+
+class ChunkCallback(Callback):
+
+    def __init__(self, pw, loop, chunks, max_chunks):
+        Callback.__init__(self, pw=pw)
+        self.loop, self.chunks, self.max_chunks = loop, chunks, max_chunks
+        self.slots = threading.Semaphore(max_chunks)
+        self.cancelled = False
+
+    def _process_data(self, data):
+        # The worker waits here while the consumer is max_chunks behind
+        self.slots.acquire()
+        if self.cancelled:
+            return False
+        self.loop.call_soon_threadsafe(self.chunks.put_nowait, data)
+        return True
+
+    def cancel(self):
+        self.cancelled = True
+        for i in range(self.max_chunks):
+            self.slots.release()
+
+
+def _stream_member(archive_path, f, c, predicate, verify_data):
+    try:
+        while True:
+            h = do_func(unrar.read_next_header, archive_path, f, c)
+            if h is None:
+                return
+            if h['is_dir'] or h['redir_type'] or not predicate(h):
+                do_func(unrar.process_file, archive_path, f, c, unrar.RAR_SKIP)
+                continue
+            crc = do_func(unrar.process_file, archive_path, f, c, unrar.RAR_TEST, -1, False, 0 if verify_data else None)
+            if verify_data and crc != h['file_crc'] & 0xffffffff:
+                raise FileCorrupt('The CRC for %r does not match. Expected: %d Got %d' % (
+                    h['filename'], h['file_crc'] & 0xffffffff, crc))
+            return h
+    finally:
+        # Marks the end of the data, after all chunks as callbacks are run in order
+        try:
+            c.loop.call_soon_threadsafe(c.chunks.put_nowait, None)
+        except RuntimeError:
+            pass  # the event loop has been closed
+
+
+def _producer(archive_path, f, c, predicate, verify_data):
+    try:
+        if c.cancelled:
+            return  # the consumer went away while this stream was queued
+        return _stream_member(archive_path, f, c, predicate, verify_data)
+    finally:
+        unrar.close_archive(f)
+
+
+async def aopen_member(
+    archive_path, predicate, password=None, verify_data=False, chunk_size=default_chunk_size, max_chunks=16, pool=None,
+    member_filter=None, stream_pool=None
+):
+    '''
+    Asynchronously yield the data of the first file in the archive for which
+    the predicate function returns True, in chunks of about chunk_size bytes.
+    Nothing is yielded if there is no such file. The archive is opened by
+    pool, the predicate is called and the file decompressed by a thread of
+    stream_pool, which waits when the consumer is max_chunks chunks behind,
+    so that memory use is bounded. A stream holds its thread until it is
+    done, so at most stream_pool.num_threads streams run at once, further
+    streams start only when an earlier one has finished or been closed. The
+    default stream pool has default_max_streams threads. If member_filter is
+    specified, only the files it selects are considered, and predicate can be
+    None.
+
+    Leaving the loop early with break stops the stream only once the
+    generator is closed, use contextlib.aclosing() to close it at once.
+    '''
+    pool = pool or default_pool()
+    stream_pool = stream_pool or default_stream_pool()
+    predicate = predicate or (lambda h: True)
+    archive_path = type('')(archive_path)
+    chunks = asyncio.Queue()
+    loop = asyncio.get_event_loop()
+    c = ChunkCallback(password, loop, chunks, max_chunks)
+    f = await pool.run(open_handle, archive_path, c, unrar.RAR_OM_EXTRACT)
+    job = None
+    try:
+        if member_filter is not None:
+            member_filter.apply(f)
+        unrar.set_callback_buffer(f, chunk_size)
+        job = stream_pool.run(_producer, archive_path, f, c, predicate, verify_data)
+        while True:
+            data = await chunks.get()
+            if data is None:
+                break
+            c.slots.release()
+            yield data
+        await job
+    finally:
+        if job is None:
+            pool.submit(unrar.close_archive, f)
+        elif not job.done():
+            # The consumer went away, stop the producer, which closes the
+            # handle, and drop its result
+            c.cancel()
+            job.cancel()
@@ -15,37 +15,159 @@
 #define write _write
 #else
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #endif
 #include <unrar/dll.hpp>
 #include <errno.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <functional>
 
 #define CALLBACK_ERROR_SZ 256
+
+// Buffering and page cache behavior for data written to output_fd
+#define OUTPUT_DIRECT 1
+#define OUTPUT_DROP_CACHE 2
+#define OUTPUT_WRITE_BEHIND 4
+#define OUTPUT_ALIGNMENT 4096
+// The most space reserved up front for a file, as the size is from the header
+#define MAX_PREALLOCATION (256ll * 1024 * 1024)
+#define NAMES_NORMALIZE 1
+#define NAMES_INTERN 2
+struct WriteBehind;
+typedef struct {
+    char *buf, *spare;
+    WriteBehind *wb;
+    size_t capacity, used;
+    unsigned int flags;
+    int saved_fl;
+    bool direct, reserved;
+    unsigned long long start;
+} OutputSink;
+
+// Counters for where the time goes during an operation, see stats()
+#define CHUNK_HISTOGRAM_SZ 12
+typedef struct {
+    unsigned long long bytes_out, chunks, files, volume_changes;
+    // Bucket i counts chunks smaller than 1024 << i, the last bucket the rest
+    unsigned long long chunk_histogram[CHUNK_HISTOGRAM_SZ];
+    unsigned long long process_ns, sink_ns, callback_ns;
+    unsigned long long gil_acquisitions, gil_wait_ns;
+} Stats;
+
+// Native selection of members, see set_filter()
+typedef struct {
+    std::unordered_set<std::wstring> names;
+    std::vector<std::wstring> globs;
+    unsigned long long min_size, max_size;
+    bool skip_dirs, skip_links;
+    // When false only the size and type are checked
+    bool check_names;
+} MemberFilter;
+
+static inline unsigned long long
+monotonic_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Adds the time from its creation to its destruction to a counter
+struct ScopedTimer {
+    unsigned long long *target, start;
+    ScopedTimer(unsigned long long *target) : target(target), start(monotonic_ns()) {}
+    ~ScopedTimer() { *target += monotonic_ns() - start; }
+};
+
+static inline void
+count_chunk(Stats *s, size_t sz) {
+    unsigned int bucket = 0;
+    while (bucket < CHUNK_HISTOGRAM_SZ - 1 && sz >= ((size_t)1024 << bucket)) bucket++;
+    s->chunk_histogram[bucket]++;
+    s->chunks++; s->bytes_out += sz;
+}
+
 typedef struct {
     HANDLE unrar_data;
     PyObject *callback_object;
-    PyGILState_STATE thread_state;
+    PyThreadState *thread_state;
     bool has_callback_error;
     char callback_error[CALLBACK_ERROR_SZ + 1];
     int output_fd;
+    bool zero_copy;
+    bool verify;
+    uint32_t crc;
+    unsigned int volume;
+    unsigned int archive_flags;
+    // The password returned by the first call to _get_password(), so that
+    // unrar asking again, for every volume, does not need the GIL
+    wchar_t *password;
+    size_t password_sz;
+    // Chunks of data for _process_data() are gathered here, so that python
+    // is called once per coalesce_capacity bytes instead of once per chunk
+    char *coalesce_buf;
+    size_t coalesce_capacity, coalesce_used;
+    bool has_output_buffer;
+    Py_buffer output_buffer;
+    size_t output_pos;
+    OutputSink sink;
+    Stats stats;
+    // The UNRARError of the module that opened the archive
+    PyObject *error;
+    // Serializes calls on the handle from different threads, see HandleLock
+    std::mutex *lock;
+    std::atomic<std::thread::id> *owner;
+    // When false, using the handle while another thread is raises instead
+    // of waiting
+    bool blocking;
+    // Used by clone() to open the archive again at the same member
+    PyObject *path;
+    unsigned int open_mode;
+    unsigned long position;
+    bool header_pending;
+    // Members that do not match are skipped by read_header()
+    MemberFilter *filter;
+    // NAMES_* flags, see set_name_options()
+    unsigned int name_flags;
 } UnrarOperation;
 
-#define ALLOW_THREADS uo->thread_state = PyGILState_Ensure();
-#define BLOCK_THREADS PyGILState_Release(uo->thread_state);
+static inline void
+block_threads(UnrarOperation *uo) {
+    unsigned long long start = monotonic_ns();
+    PyEval_RestoreThread(uo->thread_state);
+    uo->stats.gil_acquisitions++;
+    uo->stats.gil_wait_ns += monotonic_ns() - start;
+}
+
+// The GIL is released around calls into unrar and re-acquired in the callback
+// when python code needs to be run
+#define ALLOW_THREADS uo->thread_state = PyEval_SaveThread();
+#define BLOCK_THREADS block_threads(uo);
 
 #define STRFY(x) #x
 #define STRFY2(x) STRFY(x)
 #define NOMEM PyErr_SetString(PyExc_MemoryError, "Out of memory at line number: " STRFY2(__LINE__))
-#if PY_MAJOR_VERSION > 2
 #define BYTES_FMT "y#"
-#else
-#define BYTES_FMT "s#"
-#endif
 
-static PyObject *UNRARError = NULL;
+// Per interpreter state, with the module using multi-phase init there can be
+// any number of instances of it in a process
+struct module_state {
+    PyObject *error;
+    PyObject *probe_result_type;
+};
+
+#define GETSTATE(m) ((struct module_state*)PyModule_GetState(m))
 
 static inline void
-convert_rar_error(unsigned int code) {
-#define CASE(x) case x: PyErr_SetString(UNRARError, #x); break;
+convert_rar_error(PyObject *error, unsigned int code) {
+#define CASE(x) case x: PyErr_SetString(error, #x); break;
     switch(code) {
         CASE(ERAR_SUCCESS)
         CASE(ERAR_END_ARCHIVE)
@@ -68,7 +190,7 @@ convert_rar_error(unsigned int code) {
             break;
 
         default:
-            PyErr_SetString(UNRARError, "Unknown error");
+            PyErr_SetString(error, "Unknown error");
             break;
     }
 #undef CASE
@@ -77,11 +199,7 @@ convert_rar_error(unsigned int code) {
 static inline Py_ssize_t
 unicode_to_wchar(PyObject *o, wchar_t *buf, Py_ssize_t sz) {
     if (!PyUnicode_Check(o)) {PyErr_Format(PyExc_TypeError, "The python object must be a unicode object"); return -1;}
-#if PY_MAJOR_VERSION >= 3
     sz = PyUnicode_AsWideChar(o, buf, sz);
-#else
-    sz = PyUnicode_AsWideChar((PyUnicodeObject*)o, buf, sz);
-#endif
     return sz;
 }
 
@@ -94,32 +212,25 @@ wchar_to_unicode(const wchar_t *o, size_t sz) {
     return ans;
 }
 
-#define NAME "RARFileHandle"
-
-static void
-close_encapsulated_file(PyObject *capsule) {
-    if (PyCapsule_IsValid(capsule, NAME)) {
-        UnrarOperation* uo = (UnrarOperation*)PyCapsule_GetPointer(capsule, NAME);
-        if (uo->unrar_data) RARCloseArchive((HANDLE)uo->unrar_data);
-        Py_XDECREF(uo->callback_object);
-        free(uo);
-        PyCapsule_SetName(capsule, NULL); // Invalidate capsule so free is not called twice
-    }
-}
-
-
-static inline PyObject*
-encapsulate(UnrarOperation* file) {
-    PyObject *ans = NULL;
-    if (!file) return NULL;
-    ans = PyCapsule_New(file, NAME, close_encapsulated_file);
-    if (ans == NULL) { RARCloseArchive(file->unrar_data); Py_XDECREF(file->callback_object); free(file); return NULL; }
+static inline void*
+alloc_aligned(size_t sz) {
+#ifdef _WIN32
+    return _aligned_malloc(sz, OUTPUT_ALIGNMENT);
+#else
+    void *ans = NULL;
+    if (posix_memalign(&ans, OUTPUT_ALIGNMENT, sz) != 0) return NULL;
     return ans;
+#endif
 }
 
-static char _get_password[] = "_get_password";
-static char _process_data[] = "_process_data";
-
+static inline void
+free_aligned(void *p) {
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
 
 static inline bool
 write_all(const char* data, size_t sz, int fd) {
@@ -147,6 +258,382 @@ write_all(const char* data, size_t sz, int fd) {
     return true;
 }
 
+// Output sink {{{
+// A thread that writes out full buffers while unrar fills the next one, so
+// that decompression and I/O overlap. Only one buffer is pending at a time.
+struct WriteBehind {
+    std::mutex lock;
+    std::condition_variable cond;
+    const char *pending;
+    size_t pending_sz;
+    int fd, err;
+    bool stop, failed;
+    std::thread thread;
+
+    WriteBehind() : pending(NULL), pending_sz(0), fd(-1), err(0), stop(false), failed(false) {
+        thread = std::thread(&WriteBehind::run, this);
+    }
+
+    ~WriteBehind() {
+        { std::lock_guard<std::mutex> lk(lock); stop = true; }
+        cond.notify_all();
+        thread.join();
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lk(lock);
+        while (true) {
+            cond.wait(lk, [this]{ return pending != NULL || stop; });
+            if (pending == NULL) break;
+            const char *buf = pending; size_t sz = pending_sz; int output_fd = fd;
+            lk.unlock();
+            bool ok = write_all(buf, sz, output_fd);
+            int e = errno;
+            lk.lock();
+            if (!ok) { failed = true; err = e; }
+            pending = NULL;
+            cond.notify_all();
+        }
+    }
+
+    // Wait for the pending buffer to be written, returns false if any write failed
+    bool drain() {
+        std::unique_lock<std::mutex> lk(lock);
+        cond.wait(lk, [this]{ return pending == NULL; });
+        if (failed) { errno = err; return false; }
+        return true;
+    }
+
+    // buf must not be modified until the next call to submit() or drain() returns
+    bool submit(int output_fd, const char *buf, size_t sz) {
+        if (!drain()) return false;
+        { std::lock_guard<std::mutex> lk(lock); pending = buf; pending_sz = sz; fd = output_fd; }
+        cond.notify_all();
+        return true;
+    }
+
+    void reset() { drain(); failed = false; err = 0; }
+};
+
+static void
+free_sink(OutputSink *s) {
+    delete s->wb; s->wb = NULL;
+    free_aligned(s->buf); free_aligned(s->spare);
+    s->buf = NULL; s->spare = NULL; s->capacity = 0;
+}
+
+static inline void
+set_direct(int fd, OutputSink *s, bool on) {
+#if defined(O_DIRECT)
+    if (on) {
+        s->saved_fl = fcntl(fd, F_GETFL);
+        s->direct = s->saved_fl != -1 && fcntl(fd, F_SETFL, s->saved_fl | O_DIRECT) == 0;
+    } else if (s->direct) {
+        fcntl(fd, F_SETFL, s->saved_fl);
+        s->direct = false;
+    }
+#elif defined(F_NOCACHE)
+    if (on || s->direct) s->direct = fcntl(fd, F_NOCACHE, on ? 1 : 0) == 0 && on;
+#endif
+}
+
+// Called before any data is written for a file, size is the expected size of
+// the data, or negative if unknown. Must be called without the GIL.
+static void
+sink_start(UnrarOperation *uo, long long size) {
+    ScopedTimer timer(&uo->stats.sink_ns);
+    OutputSink *s = &uo->sink;
+    s->used = 0; s->direct = false; s->reserved = false; s->start = 0;
+    if (s->wb) s->wb->reset();
+#ifndef _WIN32
+    struct stat st;
+    if (fstat(uo->output_fd, &st) != 0 || !S_ISREG(st.st_mode)) return;
+    // Writes to files opened for appending go to the end, whatever the offset
+    int fl = fcntl(uo->output_fd, F_GETFL);
+    off_t pos = (fl != -1 && (fl & O_APPEND)) ? st.st_size : lseek(uo->output_fd, 0, SEEK_CUR);
+    if (pos < 0) return;
+    s->start = pos;
+#if defined(__linux__)
+    // Reserve space up front to reduce fragmentation, keeping the size so
+    // that a failed extraction does not leave zeros at the end of the file.
+    // Whatever is not used is released by sink_finish()
+    if (size > 0) s->reserved = fallocate(uo->output_fd, FALLOC_FL_KEEP_SIZE, pos, size < MAX_PREALLOCATION ? size : MAX_PREALLOCATION) == 0;
+#endif
+    // Direct I/O needs aligned offsets, so only use it when starting at an aligned offset
+    if (s->buf && (s->flags & OUTPUT_DIRECT) && pos % OUTPUT_ALIGNMENT == 0) set_direct(uo->output_fd, s, true);
+#endif
+}
+
+static inline bool
+sink_write(UnrarOperation *uo, const char *data, size_t sz) {
+    ScopedTimer timer(&uo->stats.sink_ns);
+    OutputSink *s = &uo->sink;
+    if (!s->buf) return write_all(data, sz, uo->output_fd);
+    if (!s->used && sz >= s->capacity && !s->direct && !s->wb) return write_all(data, sz, uo->output_fd);
+    while (sz > 0) {
+        size_t n = s->capacity - s->used;
+        if (n > sz) n = sz;
+        memcpy(s->buf + s->used, data, n);
+        s->used += n; data += n; sz -= n;
+        if (s->used == s->capacity) {
+            if (s->wb) {
+                if (!s->wb->submit(uo->output_fd, s->buf, s->used)) return false;
+                char *t = s->buf; s->buf = s->spare; s->spare = t;
+            } else if (!write_all(s->buf, s->used, uo->output_fd)) return false;
+            s->used = 0;
+        }
+    }
+    return true;
+}
+
+// Write out any buffered data and restore the state of output_fd. Must be
+// called without the GIL.
+static bool
+sink_finish(UnrarOperation *uo) {
+    ScopedTimer timer(&uo->stats.sink_ns);
+    OutputSink *s = &uo->sink;
+    bool ok = true;
+    int err = 0;
+    if (s->wb && !s->wb->drain()) { ok = false; err = errno; s->used = 0; }
+    if (s->used) {
+        // The last block is usually not a multiple of the alignment
+        if (s->direct && s->used % OUTPUT_ALIGNMENT) set_direct(uo->output_fd, s, false);
+        ok = write_all(s->buf, s->used, uo->output_fd);
+        err = errno;
+        s->used = 0;
+    }
+    set_direct(uo->output_fd, s, false);
+#ifndef _WIN32
+    if (s->reserved) {
+        // Release the reserved blocks past the data that was written, also
+        // after a short or failed write
+        off_t end = lseek(uo->output_fd, 0, SEEK_CUR);
+        if (end >= 0 && end < (off_t)s->start) end = s->start;
+        if (end >= 0 && ftruncate(uo->output_fd, end) != 0 && ok) { ok = false; err = errno; }
+        s->reserved = false;
+    }
+#endif
+#if !defined(_WIN32) && defined(POSIX_FADV_DONTNEED)
+    // Elsewhere, for example on macOS, there is no way to drop the pages
+    // and OUTPUT_DROP_CACHE does nothing
+    if (ok && (s->flags & OUTPUT_DROP_CACHE)) {
+        // Dirty pages cannot be dropped, so flush them first
+#if defined(_POSIX_SYNCHRONIZED_IO) && _POSIX_SYNCHRONIZED_IO > 0
+        fdatasync(uo->output_fd);
+#else
+        fsync(uo->output_fd);
+#endif
+        posix_fadvise(uo->output_fd, s->start, 0, POSIX_FADV_DONTNEED);
+    }
+#endif
+    errno = err;
+    return ok;
+}
+// }}}
+
+#define NAME "RARFileHandle"
+
+// Aggregate of the stats of all closed handles
+static Stats global_stats = {0};
+static std::mutex global_stats_lock;
+
+static void
+add_stats(Stats *dest, const Stats *src) {
+    unsigned long long *d = reinterpret_cast<unsigned long long*>(dest);
+    const unsigned long long *s = reinterpret_cast<const unsigned long long*>(src);
+    for (size_t i = 0; i < sizeof(Stats) / sizeof(unsigned long long); i++) d[i] += s[i];
+}
+
+static void
+free_password(wchar_t *password, size_t sz) {
+    if (password) {
+        // Use a volatile pointer so the compiler cannot elide the zeroing
+        volatile wchar_t *p = password;
+        for (size_t i = 0; i < sz; i++) p[i] = 0;
+        free(password);
+    }
+}
+
+static void
+forget_password(UnrarOperation *uo) {
+    free_password(uo->password, uo->password_sz);
+    uo->password = NULL; uo->password_sz = 0;
+}
+
+// Frees everything held by an open archive. Done by close_archive() with the
+// handle locked, the UnrarOperation itself lives until the capsule is
+// destroyed, as other threads may be waiting on its lock.
+static void
+release_archive(UnrarOperation *uo) {
+    if (uo->unrar_data) RARCloseArchive((HANDLE)uo->unrar_data);
+    uo->unrar_data = NULL;
+    Py_CLEAR(uo->callback_object);
+    if (uo->has_output_buffer) PyBuffer_Release(&uo->output_buffer);
+    uo->has_output_buffer = false;
+    free_sink(&uo->sink);
+    forget_password(uo);
+    free(uo->coalesce_buf);
+    uo->coalesce_buf = NULL; uo->coalesce_capacity = 0; uo->coalesce_used = 0;
+    delete uo->filter; uo->filter = NULL;
+    {
+        std::lock_guard<std::mutex> lock(global_stats_lock);
+        add_stats(&global_stats, &uo->stats);
+    }
+    memset(&uo->stats, 0, sizeof(uo->stats));
+}
+
+static void
+free_operation(UnrarOperation *uo) {
+    release_archive(uo);
+    Py_XDECREF(uo->error);
+    Py_XDECREF(uo->path);
+    delete uo->lock;
+    delete uo->owner;
+    free(uo);
+}
+
+static void
+close_encapsulated_file(PyObject *capsule) {
+    UnrarOperation* uo = (UnrarOperation*)PyCapsule_GetPointer(capsule, NAME);
+    if (uo) free_operation(uo);
+}
+
+
+static inline PyObject*
+encapsulate(UnrarOperation* file) {
+    PyObject *ans = NULL;
+    if (!file) return NULL;
+    ans = PyCapsule_New(file, NAME, close_encapsulated_file);
+    if (ans == NULL) { free_operation(file); return NULL; }
+    return ans;
+}
+
+// CRC32 {{{
+// Slice-by-8 implementation of the CRC32 used by RAR (same as zlib), so
+// that data can be verified without calling into python for every chunk
+static uint32_t crc_table[8][256];
+static std::once_flag crc_table_initialized;
+
+static void
+init_crc_table(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c & 1) ? (c >> 1) ^ 0xEDB88320u : c >> 1;
+        crc_table[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int k = 1; k < 8; k++) crc_table[k][i] = (crc_table[k-1][i] >> 8) ^ crc_table[0][crc_table[k-1][i] & 0xff];
+    }
+}
+
+static uint32_t
+crc32_update(uint32_t crc, const unsigned char *p, size_t n) {
+#define T crc_table
+    crc = ~crc;
+    while (n >= 8) {
+        uint32_t a = crc ^ (p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24));
+        uint32_t b = p[4] | (p[5] << 8) | (p[6] << 16) | ((uint32_t)p[7] << 24);
+        crc = T[7][a & 0xff] ^ T[6][(a >> 8) & 0xff] ^ T[5][(a >> 16) & 0xff] ^ T[4][a >> 24] ^
+              T[3][b & 0xff] ^ T[2][(b >> 8) & 0xff] ^ T[1][(b >> 16) & 0xff] ^ T[0][b >> 24];
+        p += 8; n -= 8;
+    }
+    while (n--) crc = T[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+#undef T
+}
+// }}}
+
+static char _get_password[] = "_get_password";
+static char _process_data[] = "_process_data";
+static char _find_volume[] = "_find_volume";
+static char _volume_opened[] = "_volume_opened";
+// The size of the volume name buffer unrar passes with UCM_CHANGEVOLUMEW, NM
+// in the unrar sources, which is 1024 in older and 2048 in newer versions
+#define VOLUME_NAME_SZ 1024
+
+
+static PyObject*
+call_process_data(UnrarOperation *uo, char *data, Py_ssize_t sz) {
+    if (uo->zero_copy) {
+        // Hand the callback a read-only view of the unrar buffer, which is
+        // only valid for the duration of the call, so release it afterwards
+        PyObject *mv = PyMemoryView_FromMemory(data, sz, PyBUF_READ);
+        if (mv == NULL) return NULL;
+        PyObject *ans = PyObject_CallMethod(uo->callback_object, _process_data, (char*)"O", mv);
+        // Calling release() with the exception from the callback pending is
+        // not allowed, keep that exception in preference to any from release()
+        PyObject *type, *value, *tb;
+        PyErr_Fetch(&type, &value, &tb);
+        PyObject *r = PyObject_CallMethod(mv, (char*)"release", NULL);
+        Py_DECREF(mv);
+        if (ans == NULL) { Py_XDECREF(r); PyErr_Clear(); PyErr_Restore(type, value, tb); }
+        else if (r == NULL) { Py_CLEAR(ans); } else Py_DECREF(r);
+        return ans;
+    }
+    return PyObject_CallMethod(uo->callback_object, _process_data, (char*)BYTES_FMT, data, sz);
+}
+
+// Call the volume hooks of the callback object, if it has them. When the
+// next volume is missing, _find_volume(path) can return a different path for
+// it, after a volume is opened _volume_opened(path) is called, for example to
+// start fetching the volume after it. Must be called with the GIL held.
+static bool
+call_volume_hook(UnrarOperation *uo, char *method, wchar_t *name, bool replace) {
+    if (!PyObject_HasAttrString(uo->callback_object, method)) return !replace;
+    ScopedTimer timer(&uo->stats.callback_ns);
+    PyObject *path = wchar_to_unicode(name, wcsnlen(name, VOLUME_NAME_SZ)), *ans = NULL;
+    bool ok = false;
+    if (path) ans = PyObject_CallMethod(uo->callback_object, method, (char*)"O", path);
+    if (ans == NULL) {
+        snprintf(uo->callback_error, CALLBACK_ERROR_SZ, "An exception occurred in the volume callback handler");
+        uo->has_callback_error = true;
+    } else if (!replace) ok = true;
+    else if (PyUnicode_Check(ans)) {
+        // The required size includes the trailing null, unrar would open a
+        // different file if the path were silently truncated to fit
+        if (PyUnicode_AsWideChar(ans, NULL, 0) > VOLUME_NAME_SZ) {
+            snprintf(uo->callback_error, CALLBACK_ERROR_SZ,
+                    "The path of the next volume returned by the volume callback handler is longer than %d characters", VOLUME_NAME_SZ - 1);
+            uo->has_callback_error = true;
+        } else {
+            Py_ssize_t sz = unicode_to_wchar(ans, name, VOLUME_NAME_SZ - 1);
+            if (sz > 0) { name[sz] = 0; ok = true; }
+        }
+    }
+    Py_XDECREF(path); Py_XDECREF(ans);
+    PyErr_Clear();
+    return ok;
+}
+
+// Pass data to _process_data(), must be called with the GIL held
+static bool
+deliver_data(UnrarOperation *uo, char *data, Py_ssize_t sz) {
+    ScopedTimer timer(&uo->stats.callback_ns);
+    bool ok = false;
+    PyObject *ret = call_process_data(uo, data, sz);
+    if (PyErr_Occurred()) {
+        snprintf(uo->callback_error, CALLBACK_ERROR_SZ, "An exception occurred in the password callback handler");
+        uo->has_callback_error = true;
+    } else {
+        ok = ret && PyObject_IsTrue(ret);
+        if (!ok) {
+            snprintf(uo->callback_error, CALLBACK_ERROR_SZ, "Processing canceled by the callback");
+            uo->has_callback_error = true;
+        }
+    }
+    Py_XDECREF(ret);
+    PyErr_Clear();
+    return ok;
+}
+
+static bool
+flush_coalesced(UnrarOperation *uo) {
+    if (!uo->coalesce_used) return true;
+    size_t used = uo->coalesce_used;
+    uo->coalesce_used = 0;
+    return deliver_data(uo, uo->coalesce_buf, used);
+}
+
 static int CALLBACK
 unrar_callback(UINT msg, LPARAM user_data, LPARAM p1, LPARAM p2) {
     int ret = -1;
@@ -159,10 +646,31 @@ unrar_callback(UINT msg, LPARAM user_data, LPARAM p1, LPARAM p2) {
     switch(msg) {
         case UCM_CHANGEVOLUME:
         case UCM_CHANGEVOLUMEW:
-            if (p2 == RAR_VOL_NOTIFY) ret = 0;
-            else {
-                snprintf(uo->callback_error, CALLBACK_ERROR_SZ, "Could not find next part of a multi-part archive");
-                uo->has_callback_error = true;
+            if (p2 == RAR_VOL_NOTIFY) {
+                // unrar sends both the wide and narrow notifications, count only one
+                ret = 0;
+                if (msg == UCM_CHANGEVOLUMEW) {
+                    uo->volume++; uo->stats.volume_changes++;
+                    if (callback) {
+                        BLOCK_THREADS;
+                        if (!call_volume_hook(uo, _volume_opened, reinterpret_cast<wchar_t*>(p1), false)) ret = -1;
+                        ALLOW_THREADS;
+                    }
+                }
+            } else {
+                // unrar asks with the wide name first, and only asks with the
+                // narrow name if the wide one was not changed
+                bool found = false;
+                if (msg == UCM_CHANGEVOLUMEW && callback) {
+                    BLOCK_THREADS;
+                    found = call_volume_hook(uo, _find_volume, reinterpret_cast<wchar_t*>(p1), true);
+                    ALLOW_THREADS;
+                }
+                if (found) ret = 0;
+                else if (!uo->has_callback_error) {
+                    snprintf(uo->callback_error, CALLBACK_ERROR_SZ, "Could not find next part of a multi-part archive");
+                    uo->has_callback_error = true;
+                }
             }
             break;
         case UCM_NEEDPASSWORD:
@@ -173,9 +681,16 @@ unrar_callback(UINT msg, LPARAM user_data, LPARAM p1, LPARAM p2) {
                 uo->has_callback_error = true;
                 break;
             }
-            if (callback) {
+            if (uo->password && uo->password_sz < (size_t)length) {
+                wmemcpy(reinterpret_cast<wchar_t*>(p1), uo->password, uo->password_sz + 1);
+                ret = 0;
+            } else if (callback) {
                 BLOCK_THREADS;
-                PyObject *pw = PyObject_CallMethod(callback, _get_password, NULL);
+                PyObject *pw;
+                {
+                    ScopedTimer timer(&uo->stats.callback_ns);
+                    pw = PyObject_CallMethod(callback, _get_password, NULL);
+                }
                 if (PyErr_Occurred()) {
                     snprintf(uo->callback_error, CALLBACK_ERROR_SZ, "An exception occurred in the password callback handler");
                     uo->has_callback_error = true;
@@ -183,8 +698,14 @@ unrar_callback(UINT msg, LPARAM user_data, LPARAM p1, LPARAM p2) {
                 if (pw && pw != Py_None) {
                     Py_ssize_t sz = unicode_to_wchar(pw, reinterpret_cast<wchar_t*>(p1), length);
                     Py_DECREF(pw);
-                    if (sz > 0) ret = 0;
-                    else {
+                    if (sz > 0) {
+                        ret = 0;
+                        forget_password(uo);
+                        if ((uo->password = (wchar_t*)malloc((sz + 1) * sizeof(wchar_t)))) {
+                            wmemcpy(uo->password, reinterpret_cast<wchar_t*>(p1), sz);
+                            uo->password[sz] = 0; uo->password_sz = sz;
+                        }
+                    } else {
                         snprintf(uo->callback_error, CALLBACK_ERROR_SZ, "The password callback handler did not return a unicode object");
                         uo->has_callback_error = true;
                     }
@@ -202,27 +723,40 @@ unrar_callback(UINT msg, LPARAM user_data, LPARAM p1, LPARAM p2) {
                 uo->has_callback_error = true;
                 break;
             }
-            if (callback) {
+            count_chunk(&uo->stats, length);
+            if (uo->verify) uo->crc = crc32_update(uo->crc, reinterpret_cast<const unsigned char*>(p1), length);
+            if (uo->has_output_buffer) {
+                if ((size_t)length > (size_t)uo->output_buffer.len - uo->output_pos) {
+                    snprintf(uo->callback_error, CALLBACK_ERROR_SZ, "The output buffer is too small");
+                    uo->has_callback_error = true;
+                } else {
+                    memcpy(reinterpret_cast<char*>(uo->output_buffer.buf) + uo->output_pos, reinterpret_cast<const char*>(p1), length);
+                    uo->output_pos += length;
+                    ret = 0;
+                }
+            } else if (callback) {
                 if (uo->output_fd > -1) {
-                    if (!write_all(reinterpret_cast<const char*>(p1), length, uo->output_fd)) {
+                    if (!sink_write(uo, reinterpret_cast<const char*>(p1), length)) {
                         snprintf(uo->callback_error, CALLBACK_ERROR_SZ, "Failed to write all bytes to output file. Error: %s", strerror(errno));
                         uo->has_callback_error = true;
                     } else ret = 0;
+                } else if (uo->coalesce_capacity && (size_t)length < uo->coalesce_capacity) {
+                    bool ok = true;
+                    if ((size_t)length > uo->coalesce_capacity - uo->coalesce_used) {
+                        BLOCK_THREADS;
+                        ok = flush_coalesced(uo);
+                        ALLOW_THREADS;
+                    }
+                    if (ok) {
+                        memcpy(uo->coalesce_buf + uo->coalesce_used, reinterpret_cast<const char*>(p1), length);
+                        uo->coalesce_used += length;
+                        ret = 0;
+                    }
                 } else {
                     BLOCK_THREADS;
-                    PyObject *pw = PyObject_CallMethod(callback, _process_data, (char*)BYTES_FMT, reinterpret_cast<char*>(p1), length);
-                    if (PyErr_Occurred()) {
-                        snprintf(uo->callback_error, CALLBACK_ERROR_SZ, "An exception occurred in the password callback handler");
-                        uo->has_callback_error = true;
-                    } else {
-                        ret = (pw && PyObject_IsTrue(pw)) ? 0 : -1;
-                        if (ret != 0) {
-                            snprintf(uo->callback_error, CALLBACK_ERROR_SZ, "Processing canceled by the callback");
-                            uo->has_callback_error = true;
-                        }
-                    }
-                    Py_XDECREF(pw);
+                    bool ok = flush_coalesced(uo) && deliver_data(uo, reinterpret_cast<char*>(p1), length);
                     ALLOW_THREADS;
+                    if (ok) ret = 0;
                 }
             } else {
                 snprintf(uo->callback_error, CALLBACK_ERROR_SZ, "No callback provided");
@@ -230,7 +764,6 @@ unrar_callback(UINT msg, LPARAM user_data, LPARAM p1, LPARAM p2) {
             }
             break;
     }
-    PyErr_Clear();
     return ret;
 #undef length
 }
@@ -238,59 +771,165 @@ unrar_callback(UINT msg, LPARAM user_data, LPARAM p1, LPARAM p2) {
 // From the RAR 5.0 standard it is 256 KB we use 512 to be safe
 #define MAX_COMMENT_LENGTH (512 * 1024)
 
+static wchar_t*
+unicode_to_wchar_alloc(PyObject *o) {
+    return PyUnicode_AsWideCharString(o, NULL);
+}
+
+// Filtering {{{
+// Match the character c against the pattern element at p, returning the
+// element after it. A [ without a closing ] is a literal, as in fnmatch.
+static const wchar_t*
+match_one(const wchar_t *p, wchar_t c, bool *ok) {
+    if (*p == L'?') { *ok = true; return p + 1; }
+    if (*p == L'[') {
+        const wchar_t *q = p + 1;
+        bool negate = *q == L'!', found = false;
+        if (negate) q++;
+        const wchar_t *start = q;
+        while (*q && (*q != L']' || q == start)) {
+            if (q[1] == L'-' && q[2] && q[2] != L']') {
+                if (q[0] <= c && c <= q[2]) found = true;
+                q += 3;
+            } else {
+                if (*q == c) found = true;
+                q++;
+            }
+        }
+        if (*q == L']') { *ok = found != negate; return q + 1; }
+    }
+    *ok = *p == c;
+    return p + 1;
+}
+
+// fnmatchcase() style matching of * ? and [seq], * matches / as well
+static bool
+glob_match(const wchar_t *p, const wchar_t *s) {
+    const wchar_t *star_p = NULL, *star_s = NULL;
+    while (*s) {
+        if (*p == L'*') { star_p = ++p; star_s = s; continue; }
+        if (*p) {
+            bool ok;
+            const wchar_t *next = match_one(p, *s, &ok);
+            if (ok) { p = next; s++; continue; }
+        }
+        if (star_p == NULL) return false;
+        p = star_p; s = ++star_s;
+    }
+    while (*p == L'*') p++;
+    return !*p;
+}
+
+static bool
+filter_matches(const MemberFilter *f, const RARHeaderDataEx *h) {
+    if (f->skip_dirs && (h->Flags & RHDF_DIRECTORY)) return false;
+    if (f->skip_links && h->RedirType) return false;
+    unsigned long long size = ((unsigned long long)h->UnpSizeHigh << 32) | h->UnpSize;
+    if (size < f->min_size || size > f->max_size) return false;
+    if (!f->check_names) return true;
+    std::wstring name(h->FileNameW);
+#ifdef _WIN32
+    for (auto &c : name) if (c == L'\\') c = L'/';
+#endif
+    if (f->names.count(name)) return true;
+    for (auto &g : f->globs) if (glob_match(g.c_str(), name.c_str())) return true;
+    return false;
+}
+// }}}
+
+// Headers are read and members processed only through these, so that the
+// position of a handle is known, see clone()
+static inline unsigned int
+process_member(UnrarOperation *uo, int operation) {
+    unsigned int retval = RARProcessFile((HANDLE)uo->unrar_data, operation, NULL, NULL);
+    uo->header_pending = false; uo->position++;
+    return retval;
+}
+
+static inline unsigned int
+read_header(UnrarOperation *uo, RARHeaderDataEx *header) {
+    while (true) {
+        unsigned int retval = RARReadHeaderEx((HANDLE)uo->unrar_data, header);
+        if (retval != ERAR_SUCCESS) return retval;
+        if (uo->filter == NULL || filter_matches(uo->filter, header)) break;
+        if ((retval = process_member(uo, RAR_SKIP)) != ERAR_SUCCESS) return retval;
+    }
+#ifdef _WIN32
+    // Elsewhere unrar already uses / and a backslash is a valid character in names
+    if (uo->name_flags & NAMES_NORMALIZE) {
+        for (wchar_t *c = header->FileNameW; *c; c++) if (*c == L'\\') *c = L'/';
+    }
+#endif
+    uo->header_pending = true;
+    return ERAR_SUCCESS;
+}
+
+// Open the archive at path for the mode and comment buffer in open_info.
+// password, which may be NULL, is a malloc()ed copy of a known password,
+// owned by the new operation, so that it is used when opening archives with
+// encrypted headers. Returns NULL with an exception set on failure.
+static UnrarOperation*
+open_operation(
+    PyObject *error, PyObject *path, PyObject *callback, bool blocking, wchar_t *password, size_t password_sz,
+    RAROpenArchiveDataEx *open_info
+) {
+    wchar_t *pathbuf = unicode_to_wchar_alloc(path);
+    if (pathbuf == NULL) { free_password(password, password_sz); return NULL; }
+    UnrarOperation *uo = (UnrarOperation*)calloc(1, sizeof(UnrarOperation));
+    if (uo == NULL) { free_password(password, password_sz); PyMem_Free(pathbuf); NOMEM; return NULL; }
+    uo->password = password; uo->password_sz = password_sz;
+    Py_INCREF(callback); uo->callback_object = callback;
+    Py_INCREF(error); uo->error = error;
+    Py_INCREF(path); uo->path = path;
+    uo->open_mode = open_info->OpenMode;
+    uo->blocking = blocking;
+    uo->lock = new (std::nothrow) std::mutex();
+    uo->owner = new (std::nothrow) std::atomic<std::thread::id>();
+    if (uo->lock == NULL || uo->owner == NULL) { PyMem_Free(pathbuf); free_operation(uo); NOMEM; return NULL; }
+    open_info->Callback = unrar_callback;
+    open_info->ArcNameW = pathbuf;
+    open_info->UserData = (LPARAM)uo;
+
+    ALLOW_THREADS;
+    uo->unrar_data = RAROpenArchiveEx(open_info);
+    BLOCK_THREADS;
+    PyMem_Free(pathbuf); open_info->ArcNameW = NULL;
+    if (!uo->unrar_data || open_info->OpenResult != ERAR_SUCCESS) {
+        free_operation(uo);
+        convert_rar_error(error, open_info->OpenResult);
+        return NULL;
+    }
+    uo->archive_flags = open_info->Flags;
+    return uo;
+}
+
 static PyObject*
 open_archive(PyObject *self, PyObject *args) {
-    PyObject *path = NULL, *callback = NULL, *get_comment = Py_False;
+    PyObject *path = NULL, *callback = NULL, *get_comment = Py_False, *ans = NULL;
     RAROpenArchiveDataEx open_info = {0};
     UnrarOperation *uo = NULL;
-    wchar_t pathbuf[4096] = {0};
-    char comment_buf[MAX_COMMENT_LENGTH];
-    int get_comments = 0;
+    // The comment buffer is large and only needed when the comment is requested
+    char *comment_buf = NULL;
+    int get_comments = 0, blocking = 1;
 
-    if (!PyArg_ParseTuple(args, "O!O|IO", &PyUnicode_Type, &path, &callback, &(open_info.OpenMode), &(get_comment))) return NULL;
-    if (unicode_to_wchar(path, pathbuf, sizeof(pathbuf) / sizeof(pathbuf[0])) < 0) return NULL;
-    open_info.Callback = unrar_callback;
-    open_info.ArcNameW = pathbuf;
-    if (open_info.ArcNameW == NULL)  goto end;
-    uo = (UnrarOperation*)calloc(1, sizeof(UnrarOperation));
-    if (uo == NULL) { NOMEM; goto end; }
-    Py_INCREF(callback); uo->callback_object = callback;
-    open_info.UserData = (LPARAM)uo;
+    if (!PyArg_ParseTuple(args, "O!O|IOp", &PyUnicode_Type, &path, &callback, &(open_info.OpenMode), &(get_comment), &blocking)) return NULL;
     get_comments = PyObject_IsTrue(get_comment);
+    if (get_comments < 0) return NULL;
     if (get_comments) {
+        comment_buf = (char*)malloc(MAX_COMMENT_LENGTH);
+        if (comment_buf == NULL) { NOMEM; return NULL; }
         open_info.CmtBuf = comment_buf;
-        open_info.CmtBufSize = sizeof(comment_buf) / sizeof(comment_buf[0]);
+        open_info.CmtBufSize = MAX_COMMENT_LENGTH;
     }
-
-    ALLOW_THREADS;
-    uo->unrar_data = RAROpenArchiveEx(&open_info);
-    BLOCK_THREADS;
-    if (!uo->unrar_data) {
-        Py_XDECREF(uo->callback_object); free(uo); uo = NULL;
-        convert_rar_error(open_info.OpenResult);
-        goto end;
-    }
-    if (open_info.OpenResult != ERAR_SUCCESS) {
-        RARCloseArchive((HANDLE)uo->unrar_data);
-        Py_XDECREF(uo->callback_object); free(uo); uo = NULL;
-        convert_rar_error(open_info.OpenResult);
-        goto end;
+    uo = open_operation(GETSTATE(self)->error, path, callback, blocking != 0, NULL, 0, &open_info);
+    if (uo != NULL) {
+        ans = encapsulate(uo);
+        if (ans != NULL && get_comments) ans = Py_BuildValue("N" BYTES_FMT, ans, open_info.CmtBuf, open_info.CmtSize ? open_info.CmtSize - 1 : 0);
     }
-
-end:
-    if (uo == NULL) return NULL;
-    PyObject *ans = encapsulate(uo);
-    if (ans == NULL) return NULL;
-    if (get_comments) return Py_BuildValue("N" BYTES_FMT, ans, open_info.CmtBuf, open_info.CmtSize ? open_info.CmtSize - 1 : 0);
+    free(comment_buf);
     return ans;
 }
 
-static PyObject*
-close_archive(PyObject *self, PyObject *capsule) {
-    close_encapsulated_file(capsule);
-    Py_RETURN_NONE;
-}
-
 static inline UnrarOperation*
 from_capsule(PyObject *file_capsule) {
     UnrarOperation *data = (UnrarOperation*)PyCapsule_GetPointer(file_capsule, NAME);
@@ -301,7 +940,69 @@ from_capsule(PyObject *file_capsule) {
     return data;
 }
 
-#define FROM_CAPSULE(x) from_capsule(x); if (uo == NULL) return NULL;
+// unrar handles are not thread safe, so calls on a handle are serialized. The
+// lock is waited for with the GIL released, as its holder may need the GIL to
+// finish, unless the handle was opened with blocking=False. A call on a handle
+// from its own callback raises instead of deadlocking. A closed handle raises
+// unless closed_ok is true, in which case uo is NULL without an exception set.
+struct HandleLock {
+    UnrarOperation *uo;
+
+    HandleLock(PyObject *capsule, bool closed_ok = false) : uo(from_capsule(capsule)) {
+        if (uo == NULL) return;
+        if (uo->owner->load() == std::this_thread::get_id()) {
+            uo = NULL;
+            PyErr_SetString(PyExc_RuntimeError, "The archive cannot be used from within its own callback");
+            return;
+        }
+        if (!uo->lock->try_lock()) {
+            if (!uo->blocking) {
+                uo = NULL;
+                PyErr_SetString(PyExc_RuntimeError, "The archive is in use by another thread");
+                return;
+            }
+            Py_BEGIN_ALLOW_THREADS;
+            uo->lock->lock();
+            Py_END_ALLOW_THREADS;
+        }
+        if (uo->unrar_data == NULL) {
+            uo->lock->unlock(); uo = NULL;
+            if (!closed_ok) PyErr_SetString(PyExc_ValueError, "The archive has been closed");
+            return;
+        }
+        uo->owner->store(std::this_thread::get_id());
+    }
+
+    ~HandleLock() {
+        if (uo == NULL) return;
+        uo->owner->store(std::thread::id());
+        uo->lock->unlock();
+    }
+};
+
+#define LOCK_HANDLE(x) HandleLock handle_lock(x); UnrarOperation *uo = handle_lock.uo; if (uo == NULL) return NULL;
+
+static PyObject*
+close_archive(PyObject *self, PyObject *capsule) {
+    HandleLock handle_lock(capsule, true);
+    UnrarOperation *uo = handle_lock.uo;
+    if (uo == NULL) {
+        if (PyErr_Occurred()) return NULL;
+        Py_RETURN_NONE;  // already closed
+    }
+    release_archive(uo);
+    Py_RETURN_NONE;
+}
+
+static inline void
+convert_process_error(UnrarOperation *uo, unsigned int retval) {
+    // Ask the callback again next time, in case the password was wrong
+    if (retval == ERAR_BAD_PASSWORD || retval == ERAR_BAD_DATA) forget_password(uo);
+    // unrar fails with ERAR_EOPEN when the volume callback could not provide the next volume
+    if ((retval == ERAR_UNKNOWN || retval == ERAR_EOPEN) && uo->has_callback_error) {
+        PyErr_SetString(uo->error, uo->callback_error);
+    } else convert_rar_error(uo->error, retval);
+}
 
 static inline unsigned long long
 combine(unsigned int h, unsigned int l) {
@@ -309,30 +1010,48 @@ combine(unsigned int h, unsigned int l) {
     return (ans << 32) | l;
 }
 
+// The parts of RARHeaderDataEx that are exposed to python. RARHeaderDataEx
+// is over 10KB in size, so this is what is stored when reading many headers.
+typedef struct {
+    unsigned int flags, host_os, file_crc, file_time, unpack_ver, method, file_attr, redir_type, volume;
+    unsigned long long pack_size, unpack_size;
+    const wchar_t *filename, *redir_name;
+    size_t filename_sz, redir_name_sz;
+} HeaderRecord;
+
+static inline void
+fill_record(HeaderRecord *r, const RARHeaderDataEx *fh, unsigned int volume) {
+    r->flags = fh->Flags; r->host_os = fh->HostOS; r->file_crc = fh->FileCRC; r->file_time = fh->FileTime;
+    r->unpack_ver = fh->UnpVer; r->method = fh->Method; r->file_attr = fh->FileAttr; r->redir_type = fh->RedirType;
+    r->volume = volume;
+    r->pack_size = combine(fh->PackSizeHigh, fh->PackSize);
+    r->unpack_size = combine(fh->UnpSizeHigh, fh->UnpSize);
+    r->filename = fh->FileNameW; r->filename_sz = wcslen(fh->FileNameW);
+    r->redir_name = fh->RedirName; r->redir_name_sz = fh->RedirName ? fh->RedirNameSize : 0;
+}
+
 static PyObject*
-header_to_python(RARHeaderDataEx *fh, HANDLE data) {
+header_to_python(const HeaderRecord *fh) {
     PyObject *ans = PyDict_New(), *temp, *filename;
     if (!ans) return NULL;
-    filename = wchar_to_unicode(fh->FileNameW, wcslen(fh->FileNameW));
+    filename = wchar_to_unicode(fh->filename, fh->filename_sz);
     if(!filename) goto error;
 #define AVAL(name, code, val) {if (!(temp = Py_BuildValue(code, (val)))) goto error; if (PyDict_SetItemString(ans, name, temp) != 0) goto error; Py_DECREF(temp); temp = NULL;}
     AVAL("filename", "N", filename);
-    AVAL("flags", "H", fh->Flags);
-    AVAL("pack_size", "K", combine(fh->PackSizeHigh, fh->PackSize));
-    AVAL("unpack_size", "K", combine(fh->UnpSizeHigh, fh->UnpSize));
-    AVAL("host_os", "b", fh->HostOS);
-    AVAL("file_crc", "I", fh->FileCRC);
-    AVAL("file_time", "I", fh->FileTime);
-    AVAL("unpack_ver", "b", fh->UnpVer);
-    AVAL("method", "b", fh->Method);
-    AVAL("file_attr", "I", fh->FileAttr);
-    AVAL("is_dir", "O", fh->Flags & RHDF_DIRECTORY ? Py_True : Py_False);
-    // AVAL("atime", "K", combine(fh->AtimeHigh, fh->AtimeLow));
-    // AVAL("ctime", "K", combine(fh->CtimeHigh, fh->CtimeLow));
-    // AVAL("mtime", "K", combine(fh->MtimeHigh, fh->MtimeLow));
-    AVAL("redir_type", "I", fh->RedirType);
-    if (fh->RedirNameSize > 0) {
-        filename = wchar_to_unicode(fh->RedirName, fh->RedirNameSize);
+    AVAL("flags", "H", fh->flags);
+    AVAL("pack_size", "K", fh->pack_size);
+    AVAL("unpack_size", "K", fh->unpack_size);
+    AVAL("host_os", "b", fh->host_os);
+    AVAL("file_crc", "I", fh->file_crc);
+    AVAL("file_time", "I", fh->file_time);
+    AVAL("unpack_ver", "b", fh->unpack_ver);
+    AVAL("method", "b", fh->method);
+    AVAL("file_attr", "I", fh->file_attr);
+    AVAL("is_dir", "O", fh->flags & RHDF_DIRECTORY ? Py_True : Py_False);
+    AVAL("redir_type", "I", fh->redir_type);
+    AVAL("volume", "I", fh->volume);
+    if (fh->redir_name_sz > 0) {
+        filename = wchar_to_unicode(fh->redir_name, fh->redir_name_sz);
         if (!filename) goto error;
         AVAL("redir_name", "N", filename);
     }
@@ -344,98 +1063,1148 @@ error:
 }
 
 
+static PyObject*
+archive_info(PyObject *self, PyObject *file_capsule) {
+    LOCK_HANDLE(file_capsule);
+    unsigned int flags = uo->archive_flags;
+#define F(x) ((flags & (x)) ? Py_True : Py_False)
+    return Py_BuildValue("{sI sO sO sO sO sO sO sO sO sO sI}",
+        "flags", flags, "is_volume", F(ROADF_VOLUME), "is_first_volume", F(ROADF_FIRSTVOLUME),
+        "is_solid", F(ROADF_SOLID), "is_locked", F(ROADF_LOCK), "has_comment", F(ROADF_COMMENT),
+        "has_recovery_record", F(ROADF_RECOVERY), "is_signed", F(ROADF_SIGNED), "new_numbering", F(ROADF_NEWNUMBERING),
+        "encrypted_headers", F(ROADF_ENCHEADERS), "volume", uo->volume);
+#undef F
+}
+
 static PyObject*
 read_next_header(PyObject *self, PyObject *file_capsule) {
-    UnrarOperation *uo = FROM_CAPSULE(file_capsule);
-    HANDLE data = uo->unrar_data;
+    LOCK_HANDLE(file_capsule);
     RARHeaderDataEx header = {0};  // Cannot be static as it has to be initialized to zero
     ALLOW_THREADS;
-    unsigned int retval = RARReadHeaderEx((HANDLE)data, &header);
+    unsigned int retval = read_header(uo, &header);
     BLOCK_THREADS;
 
     switch(retval) {
         case ERAR_END_ARCHIVE:
             Py_RETURN_NONE;
             break;
-        case ERAR_SUCCESS:
-            return header_to_python(&header, data);
-            break;
+        case ERAR_SUCCESS: {
+            HeaderRecord r;
+            fill_record(&r, &header, uo->volume);
+            return header_to_python(&r);
+        }
         default:
-            convert_rar_error(retval);
+            convert_rar_error(uo->error, retval);
             break;
     }
     return NULL;
 }
 
 
+static inline void
+free_records(HeaderRecord *records, size_t count) {
+    for (size_t i = 0; i < count; i++) free((void*)records[i].filename);
+    free(records);
+}
+
+// Read all remaining headers, skipping the files. Must be called with the GIL
+// released. Returns ERAR_END_ARCHIVE on success.
+static unsigned int
+collect_headers(UnrarOperation *uo, HeaderRecord **precords, size_t *pcount) {
+    RARHeaderDataEx header;
+    HeaderRecord *records = NULL, *r;
+    size_t count = 0, capacity = 0;
+    unsigned int retval;
+
+    while (true) {
+        memset(&header, 0, sizeof(header));
+        retval = read_header(uo, &header);
+        if (retval != ERAR_SUCCESS) break;
+        if (count >= capacity) {
+            capacity = capacity ? 2 * capacity : 256;
+            r = (HeaderRecord*)realloc(records, capacity * sizeof(HeaderRecord));
+            if (r == NULL) { retval = ERAR_NO_MEMORY; break; }
+            records = r;
+        }
+        r = records + count;
+        fill_record(r, &header, uo->volume);
+        // Copy the names, as the header buffer is re-used
+        wchar_t *names = (wchar_t*)malloc((r->filename_sz + r->redir_name_sz + 1) * sizeof(wchar_t));
+        if (names == NULL) { retval = ERAR_NO_MEMORY; break; }
+        memcpy(names, r->filename, r->filename_sz * sizeof(wchar_t));
+        if (r->redir_name_sz) memcpy(names + r->filename_sz, r->redir_name, r->redir_name_sz * sizeof(wchar_t));
+        r->filename = names; r->redir_name = names + r->filename_sz;
+        count++;
+        retval = process_member(uo, RAR_SKIP);
+        if (retval != ERAR_SUCCESS) break;
+    }
+    *precords = records; *pcount = count;
+    return retval;
+}
+
 static PyObject*
-process_file(PyObject *self, PyObject *args) {
-    int operation = RAR_TEST, output_fd = -1;
+read_all_headers(PyObject *self, PyObject *file_capsule) {
+    LOCK_HANDLE(file_capsule);
+    HeaderRecord *records = NULL;
+    size_t count = 0;
+    PyObject *ans = NULL, *h;
+
+    uo->output_fd = -1; uo->verify = false;
+    ALLOW_THREADS;
+    unsigned int retval = collect_headers(uo, &records, &count);
+    BLOCK_THREADS;
+
+    if (retval != ERAR_END_ARCHIVE) convert_process_error(uo, retval);
+    else if ((ans = PyList_New(count))) {
+        for (size_t i = 0; i < count; i++) {
+            if (!(h = header_to_python(records + i))) { Py_CLEAR(ans); break; }
+            PyList_SET_ITEM(ans, i, h);
+        }
+    }
+    free_records(records, count);
+    return ans;
+}
+
+// Encode to UTF-8, dest must have room for 4 * sz bytes. wchar_t is UTF-16
+// on Windows and UTF-32 elsewhere, invalid code points become U+FFFD
+static size_t
+wchar_to_utf8(const wchar_t *src, size_t sz, char *dest) {
+    unsigned char *d = reinterpret_cast<unsigned char*>(dest);
+    for (size_t i = 0; i < sz; i++) {
+        uint32_t c = (uint32_t)src[i];
+        if (0xd800 <= c && c < 0xe000) {
+            if (sizeof(wchar_t) == 2 && c < 0xdc00 && i + 1 < sz && 0xdc00 <= (uint32_t)src[i+1] && (uint32_t)src[i+1] < 0xe000) {
+                c = 0x10000 + ((c - 0xd800) << 10) + ((uint32_t)src[i+1] - 0xdc00);
+                i++;
+            } else c = 0xfffd;
+        }
+        if (c > 0x10ffff) c = 0xfffd;
+        if (c < 0x80) *(d++) = c;
+        else if (c < 0x800) { *(d++) = 0xc0 | (c >> 6); *(d++) = 0x80 | (c & 0x3f); }
+        else if (c < 0x10000) { *(d++) = 0xe0 | (c >> 12); *(d++) = 0x80 | ((c >> 6) & 0x3f); *(d++) = 0x80 | (c & 0x3f); }
+        else { *(d++) = 0xf0 | (c >> 18); *(d++) = 0x80 | ((c >> 12) & 0x3f); *(d++) = 0x80 | ((c >> 6) & 0x3f); *(d++) = 0x80 | (c & 0x3f); }
+    }
+    return d - reinterpret_cast<unsigned char*>(dest);
+}
+
+// A memoryview of the specified format over a new bytes object of count items
+static PyObject*
+new_column(const char *fmt, Py_ssize_t itemsize, Py_ssize_t count, char **data) {
+    PyObject *b = PyBytes_FromStringAndSize(NULL, itemsize * count);
+    if (b == NULL) return NULL;
+    *data = PyBytes_AS_STRING(b);
+    PyObject *mv = PyMemoryView_FromObject(b);
+    Py_DECREF(b);
+    if (mv == NULL) return NULL;
+    PyObject *ans = PyObject_CallMethod(mv, (char*)"cast", (char*)"s", fmt);
+    Py_DECREF(mv);
+    return ans;
+}
+
+static inline bool
+is_separator(wchar_t c) {
+#ifdef _WIN32
+    return c == L'/' || c == L'\\';
+#else
+    return c == L'/';
+#endif
+}
+
+// Store the directory part of every name, with its trailing separator, once
+// in dirs, and its index in the dir column. Index zero is the empty string,
+// for names without a directory. starts receives where the rest of each name
+// begins. Returns false with an exception set on failure.
+static bool
+intern_dirs(const HeaderRecord *records, size_t count, PyObject *columns, PyObject *dirs, size_t *starts) {
+    char *data;
+    PyObject *col = new_column("I", sizeof(uint32_t), count, &data);
+    if (col == NULL) return false;
+    if (PyDict_SetItemString(columns, "dir", col) != 0) { Py_DECREF(col); return false; }
+    Py_DECREF(col);
+    uint32_t *d = reinterpret_cast<uint32_t*>(data);
+    try {
+        std::unordered_map<std::wstring, uint32_t> seen;
+        for (size_t i = 0; i < count; i++) {
+            const wchar_t *name = records[i].filename;
+            size_t k = records[i].filename_sz;
+            while (k > 0 && !is_separator(name[k - 1])) k--;
+            starts[i] = k; d[i] = 0;
+            if (k == 0) continue;
+            std::wstring dir(name, k);
+            auto it = seen.find(dir);
+            if (it != seen.end()) { d[i] = it->second; continue; }
+            PyObject *x = wchar_to_unicode(name, k);
+            if (x == NULL) return false;
+            d[i] = PyList_GET_SIZE(dirs);
+            if (PyList_Append(dirs, x) != 0) { Py_DECREF(x); return false; }
+            Py_DECREF(x);
+            seen[dir] = d[i];
+        }
+    } catch (const std::bad_alloc&) { PyErr_NoMemory(); return false; }
+    return true;
+}
+
+static PyObject*
+build_header_table(const HeaderRecord *records, size_t count, unsigned int name_flags) {
+    PyObject *columns = NULL, *names = NULL, *offsets = NULL, *dirs = NULL, *col;
+    char *data;
+    size_t total = 0, pos = 0, *starts = NULL;
+    uint64_t *o;
+    Py_ssize_t n = count;
+
+    if (!(columns = PyDict_New())) goto error;
+#define COLUMN(name, fmt, type, field) { \
+    if (!(col = new_column(fmt, sizeof(type), n, &data))) goto error; \
+    if (PyDict_SetItemString(columns, name, col) != 0) { Py_DECREF(col); goto error; } \
+    Py_DECREF(col); \
+    for (size_t i = 0; i < count; i++) reinterpret_cast<type*>(data)[i] = (type)records[i].field; \
+}
+    COLUMN("pack_size", "Q", unsigned long long, pack_size);
+    COLUMN("unpack_size", "Q", unsigned long long, unpack_size);
+    COLUMN("file_crc", "I", unsigned int, file_crc);
+    COLUMN("file_time", "I", unsigned int, file_time);
+    COLUMN("flags", "H", unsigned short, flags);
+    COLUMN("file_attr", "I", unsigned int, file_attr);
+    COLUMN("method", "B", unsigned char, method);
+    COLUMN("redir_type", "B", unsigned char, redir_type);
+    COLUMN("volume", "I", unsigned int, volume);
+#undef COLUMN
+
+    if (!(starts = (size_t*)calloc(count + 1, sizeof(size_t)))) { PyErr_NoMemory(); goto error; }
+    if (name_flags & NAMES_INTERN) {
+        if (!(dirs = Py_BuildValue("[s]", ""))) goto error;
+        if (!intern_dirs(records, count, columns, dirs, starts)) goto error;
+    }
+    if (!(offsets = new_column("Q", sizeof(uint64_t), n + 1, &data))) goto error;
+    o = reinterpret_cast<uint64_t*>(data);
+    for (size_t i = 0; i < count; i++) total += records[i].filename_sz - starts[i];
+    if (!(names = PyBytes_FromStringAndSize(NULL, 4 * total))) goto error;
+    data = PyBytes_AS_STRING(names);
+    for (size_t i = 0; i < count; i++) {
+        o[i] = pos;
+        pos += wchar_to_utf8(records[i].filename + starts[i], records[i].filename_sz - starts[i], data + pos);
+    }
+    o[count] = pos;
+    if (_PyBytes_Resize(&names, pos) != 0) goto error;
+    free(starts);
+    if (dirs) return Py_BuildValue("NNNN", columns, names, offsets, dirs);
+    return Py_BuildValue("NNN", columns, names, offsets);
+error:
+    free(starts);
+    Py_XDECREF(columns); Py_XDECREF(names); Py_XDECREF(offsets); Py_XDECREF(dirs);
+    return NULL;
+}
+
+static PyObject*
+read_header_table(PyObject *self, PyObject *file_capsule) {
+    LOCK_HANDLE(file_capsule);
+    HeaderRecord *records = NULL;
+    size_t count = 0;
+    PyObject *ans = NULL;
+
+    uo->output_fd = -1; uo->verify = false;
+    ALLOW_THREADS;
+    unsigned int retval = collect_headers(uo, &records, &count);
+    BLOCK_THREADS;
+
+    if (retval != ERAR_END_ARCHIVE) convert_process_error(uo, retval);
+    else ans = build_header_table(records, count, uo->name_flags);
+    free_records(records, count);
+    return ans;
+}
+
+static PyObject*
+skip_headers(PyObject *self, PyObject *args) {
+    PyObject *file_capsule;
+    unsigned long count = 0, skipped = 0;
+    RARHeaderDataEx header;
+    unsigned int retval = ERAR_SUCCESS;
+
+    if (!PyArg_ParseTuple(args, "Ok", &file_capsule, &count)) return NULL;
+    LOCK_HANDLE(file_capsule);
+    uo->output_fd = -1; uo->verify = false;
+    ALLOW_THREADS;
+    while (skipped < count) {
+        memset(&header, 0, sizeof(header));
+        retval = read_header(uo, &header);
+        if (retval != ERAR_SUCCESS) break;
+        retval = process_member(uo, RAR_SKIP);
+        if (retval != ERAR_SUCCESS) break;
+        skipped++;
+    }
+    BLOCK_THREADS;
+    if (retval != ERAR_SUCCESS && retval != ERAR_END_ARCHIVE) { convert_process_error(uo, retval); return NULL; }
+    return PyLong_FromUnsignedLong(skipped);
+}
+
+static PyObject*
+clone(PyObject *self, PyObject *args) {
+    PyObject *file_capsule, *callback, *path;
+    RAROpenArchiveDataEx open_info = {0};
+    RARHeaderDataEx header;
+    PyObject *error;
+    unsigned long position;
+    bool header_pending, blocking;
+    unsigned int name_flags;
+    MemberFilter *filter = NULL;
+    wchar_t *password = NULL;
+    size_t password_sz = 0;
+
+    if (!PyArg_ParseTuple(args, "OO", &file_capsule, &callback)) return NULL;
+    {
+        // Only the state needed to reopen is copied, so that the handle is not
+        // blocked while the clone skips to the position
+        LOCK_HANDLE(file_capsule);
+        error = uo->error; path = uo->path;
+        Py_INCREF(error); Py_INCREF(path);
+        open_info.OpenMode = uo->open_mode;
+        position = uo->position; header_pending = uo->header_pending; blocking = uo->blocking;
+        name_flags = uo->name_flags;
+        if (uo->filter) {
+            filter = new (std::nothrow) MemberFilter(*uo->filter);
+            if (filter == NULL) { Py_DECREF(error); Py_DECREF(path); return PyErr_NoMemory(); }
+        }
+        if (uo->password) {
+            password = (wchar_t*)malloc((uo->password_sz + 1) * sizeof(wchar_t));
+            if (password == NULL) { delete filter; Py_DECREF(error); Py_DECREF(path); return PyErr_NoMemory(); }
+            wmemcpy(password, uo->password, uo->password_sz + 1);
+            password_sz = uo->password_sz;
+        }
+    }
+    UnrarOperation *uo = open_operation(error, path, callback, blocking, password, password_sz, &open_info);
+    Py_DECREF(error); Py_DECREF(path);
+    if (uo == NULL) { delete filter; return NULL; }
+    uo->filter = filter; uo->name_flags = name_flags;
+
+    unsigned int retval = ERAR_SUCCESS;
+    uo->output_fd = -1; uo->verify = false;
+    ALLOW_THREADS;
+    while (uo->position < position) {
+        memset(&header, 0, sizeof(header));
+        if ((retval = read_header(uo, &header)) != ERAR_SUCCESS) break;
+        if ((retval = process_member(uo, RAR_SKIP)) != ERAR_SUCCESS) break;
+    }
+    if (retval == ERAR_SUCCESS && header_pending) {
+        memset(&header, 0, sizeof(header));
+        retval = read_header(uo, &header);
+    }
+    BLOCK_THREADS;
+    if (retval != ERAR_SUCCESS) {
+        convert_process_error(uo, retval);
+        free_operation(uo);
+        return NULL;
+    }
+    return encapsulate(uo);
+}
+
+static bool
+add_strings(PyObject *seq, std::function<void(std::wstring&&)> add) {
+    if (seq == Py_None) return true;
+    PyObject *items = PySequence_Fast(seq, "names and globs must be sequences of strings");
+    if (items == NULL) return false;
+    for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(items); i++) {
+        PyObject *x = PySequence_Fast_GET_ITEM(items, i);
+        Py_ssize_t sz;
+        wchar_t *w = PyUnicode_Check(x) ? PyUnicode_AsWideCharString(x, &sz) : NULL;
+        if (w == NULL) {
+            if (!PyErr_Occurred()) PyErr_SetString(PyExc_TypeError, "names and globs must be sequences of strings");
+            Py_DECREF(items);
+            return false;
+        }
+        add(std::wstring(w, sz));
+        PyMem_Free(w);
+    }
+    Py_DECREF(items);
+    return true;
+}
+
+static PyObject*
+set_filter(PyObject *self, PyObject *args) {
+    PyObject *file_capsule, *names = Py_None, *globs = Py_None;
+    unsigned long long min_size = 0, max_size = ~0ull;
+    int skip_dirs = 0, skip_links = 0;
+
+    if (!PyArg_ParseTuple(args, "O|OOKKpp", &file_capsule, &names, &globs, &min_size, &max_size, &skip_dirs, &skip_links)) return NULL;
+    LOCK_HANDLE(file_capsule);
+    MemberFilter *f = NULL;
+    bool select = names != Py_None || globs != Py_None;
+    if (select || min_size || max_size != ~0ull || skip_dirs || skip_links) {
+        f = new (std::nothrow) MemberFilter();
+        if (f == NULL) return PyErr_NoMemory();
+        f->min_size = min_size; f->max_size = max_size;
+        f->skip_dirs = skip_dirs != 0; f->skip_links = skip_links != 0; f->check_names = select;
+        try {
+            if (!add_strings(names, [f](std::wstring &&x) { f->names.insert(x); }) ||
+                !add_strings(globs, [f](std::wstring &&x) { f->globs.push_back(x); })) { delete f; return NULL; }
+        } catch (const std::bad_alloc&) { delete f; return PyErr_NoMemory(); }
+    }
+    delete uo->filter;
+    uo->filter = f;
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+set_output_buffer(PyObject *self, PyObject *args) {
+    PyObject *file_capsule, *buffer = Py_None, *ans;
+    Py_ssize_t offset = 0;
+
+    if (!PyArg_ParseTuple(args, "O|On", &file_capsule, &buffer, &offset)) return NULL;
+    LOCK_HANDLE(file_capsule);
+    if (uo->has_output_buffer) {
+        ans = PyLong_FromSize_t(uo->output_pos);
+        if (ans == NULL) return NULL;
+        PyBuffer_Release(&uo->output_buffer);
+        uo->has_output_buffer = false;
+    } else { ans = Py_None; Py_INCREF(ans); }
+    if (buffer != Py_None) {
+        if (PyObject_GetBuffer(buffer, &uo->output_buffer, PyBUF_WRITABLE | PyBUF_C_CONTIGUOUS) != 0) { Py_DECREF(ans); return NULL; }
+        if (offset < 0 || offset > uo->output_buffer.len) {
+            PyBuffer_Release(&uo->output_buffer);
+            Py_DECREF(ans);
+            PyErr_SetString(PyExc_ValueError, "The offset is outside the buffer");
+            return NULL;
+        }
+        uo->has_output_buffer = true;
+        uo->output_pos = offset;
+    }
+    return ans;
+}
+
+static PyObject*
+set_output_bytes(PyObject *self, PyObject *args) {
+    PyObject *file_capsule, *ans;
+    Py_ssize_t size = 0;
+
+    if (!PyArg_ParseTuple(args, "On", &file_capsule, &size)) return NULL;
+    LOCK_HANDLE(file_capsule);
+    if (size < 0) { PyErr_SetString(PyExc_ValueError, "The size must not be negative"); return NULL; }
+    if (!(ans = PyBytes_FromStringAndSize(NULL, size))) return NULL;
+    if (uo->has_output_buffer) { PyBuffer_Release(&uo->output_buffer); uo->has_output_buffer = false; }
+    // The bytes object is filled in place, before anything can have hashed it
+    if (PyBuffer_FillInfo(&uo->output_buffer, ans, PyBytes_AS_STRING(ans), size, 0, PyBUF_WRITABLE) != 0) { Py_DECREF(ans); return NULL; }
+    uo->has_output_buffer = true;
+    uo->output_pos = 0;
+    return ans;
+}
+
+static PyObject*
+stats_to_python(const Stats *s) {
+    PyObject *histogram = PyTuple_New(CHUNK_HISTOGRAM_SZ);
+    if (histogram == NULL) return NULL;
+    for (Py_ssize_t i = 0; i < CHUNK_HISTOGRAM_SZ; i++) {
+        PyObject *x = PyLong_FromUnsignedLongLong(s->chunk_histogram[i]);
+        if (x == NULL) { Py_DECREF(histogram); return NULL; }
+        PyTuple_SET_ITEM(histogram, i, x);
+    }
+    // Time in RARProcessFile not spent writing or in callbacks is time spent decompressing
+    unsigned long long other = s->sink_ns + s->callback_ns;
+    return Py_BuildValue("{sK sK sK sK sN sK sK sK sK sK sK}",
+        "bytes_out", s->bytes_out, "chunks", s->chunks, "files", s->files, "volume_changes", s->volume_changes,
+        "chunk_histogram", histogram, "process_ns", s->process_ns,
+        "decompress_ns", s->process_ns > other ? s->process_ns - other : 0ull,
+        "sink_ns", s->sink_ns, "callback_ns", s->callback_ns,
+        "gil_acquisitions", s->gil_acquisitions, "gil_wait_ns", s->gil_wait_ns);
+}
+
+static PyObject*
+stats(PyObject *self, PyObject *args) {
+    PyObject *file_capsule = Py_None, *ans;
+    int reset = 0;
+
+    if (!PyArg_ParseTuple(args, "|Op", &file_capsule, &reset)) return NULL;
+    if (file_capsule == Py_None) {
+        std::lock_guard<std::mutex> lock(global_stats_lock);
+        ans = stats_to_python(&global_stats);
+        if (ans && reset) memset(&global_stats, 0, sizeof(global_stats));
+        return ans;
+    }
+    LOCK_HANDLE(file_capsule);
+    ans = stats_to_python(&uo->stats);
+    if (ans && reset) memset(&uo->stats, 0, sizeof(uo->stats));
+    return ans;
+}
+
+static PyObject*
+set_callback_buffer(PyObject *self, PyObject *args) {
+    PyObject *file_capsule;
+    Py_ssize_t size = 0;
+
+    if (!PyArg_ParseTuple(args, "O|n", &file_capsule, &size)) return NULL;
+    LOCK_HANDLE(file_capsule);
+    if (size < 0) { PyErr_SetString(PyExc_ValueError, "The buffer size must not be negative"); return NULL; }
+    if ((size_t)size != uo->coalesce_capacity) {
+        char *buf = size ? (char*)malloc(size) : NULL;
+        if (size && buf == NULL) return PyErr_NoMemory();
+        free(uo->coalesce_buf);
+        uo->coalesce_buf = buf; uo->coalesce_capacity = size; uo->coalesce_used = 0;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+set_output_options(PyObject *self, PyObject *args) {
     PyObject *file_capsule;
+    Py_ssize_t buffer_size = 0;
+    unsigned int flags = 0;
 
-    if (!PyArg_ParseTuple(args, "O|ii", &file_capsule, &operation, &output_fd)) return NULL;
-    UnrarOperation *uo = FROM_CAPSULE(file_capsule);
+    if (!PyArg_ParseTuple(args, "O|nI", &file_capsule, &buffer_size, &flags)) return NULL;
+    LOCK_HANDLE(file_capsule);
+    if (buffer_size < 0) { PyErr_SetString(PyExc_ValueError, "The buffer size must not be negative"); return NULL; }
+    // Keep the buffer a multiple of the alignment, for direct I/O
+    size_t capacity = ((buffer_size + OUTPUT_ALIGNMENT - 1) / OUTPUT_ALIGNMENT) * OUTPUT_ALIGNMENT;
+    bool write_behind = capacity && (flags & OUTPUT_WRITE_BEHIND);
+    if (capacity != uo->sink.capacity || write_behind != (uo->sink.wb != NULL)) {
+        free_sink(&uo->sink);
+        if (capacity) {
+            uo->sink.buf = (char*)alloc_aligned(capacity);
+            if (write_behind) uo->sink.spare = (char*)alloc_aligned(capacity);
+            if (uo->sink.buf == NULL || (write_behind && uo->sink.spare == NULL)) { free_sink(&uo->sink); return PyErr_NoMemory(); }
+            uo->sink.capacity = capacity;
+            if (write_behind) {
+                try {
+                    uo->sink.wb = new WriteBehind();
+                } catch (const std::exception &err) {
+                    free_sink(&uo->sink);
+                    PyErr_Format(PyExc_OSError, "Failed to start the write behind thread: %s", err.what());
+                    return NULL;
+                }
+            }
+        }
+    }
+    uo->sink.flags = flags;
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+set_name_options(PyObject *self, PyObject *args) {
+    PyObject *file_capsule;
+    unsigned int flags = 0;
+
+    if (!PyArg_ParseTuple(args, "O|I", &file_capsule, &flags)) return NULL;
+    LOCK_HANDLE(file_capsule);
+    uo->name_flags = flags;
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+process_file(PyObject *self, PyObject *args) {
+    int operation = RAR_TEST, output_fd = -1, zero_copy = 0;
+    PyObject *file_capsule, *crc = Py_None;
+    long long size = -1;
+    bool sink_ok = true;
+
+    if (!PyArg_ParseTuple(args, "O|iipOL", &file_capsule, &operation, &output_fd, &zero_copy, &crc, &size)) return NULL;
+    LOCK_HANDLE(file_capsule);
+    uo->verify = crc != Py_None;
+    if (uo->verify) {
+        uo->crc = (uint32_t)PyLong_AsUnsignedLongMask(crc);
+        if (PyErr_Occurred()) return NULL;
+    }
     uo->output_fd = output_fd;
-    HANDLE data = uo->unrar_data;
+    uo->zero_copy = zero_copy != 0;
+    unsigned int retval;
     ALLOW_THREADS;
-    unsigned int retval = RARProcessFile(data, operation, NULL, NULL);
+    {
+        ScopedTimer timer(&uo->stats.process_ns);
+        if (output_fd > -1) sink_start(uo, size);
+        retval = process_member(uo, operation);
+        if (output_fd > -1) sink_ok = sink_finish(uo);
+    }
     BLOCK_THREADS;
-    if (retval == ERAR_SUCCESS) { Py_RETURN_NONE; }
-    if (retval == ERAR_UNKNOWN && uo->has_callback_error) {
-        PyErr_SetString(UNRARError, uo->callback_error);
-    } else convert_rar_error(retval);
+    if (operation != RAR_SKIP) uo->stats.files++;
+    // Data gathered for _process_data() is delivered when the member ends
+    if (retval == ERAR_SUCCESS) {
+        // Timed as part of processing the member, as callback_ns is a part of process_ns
+        ScopedTimer timer(&uo->stats.process_ns);
+        if (!flush_coalesced(uo)) {
+            PyErr_SetString(uo->error, uo->callback_error);
+            return NULL;
+        }
+    }
+    uo->coalesce_used = 0;
+    if (retval == ERAR_SUCCESS && !sink_ok) {
+        snprintf(uo->callback_error, CALLBACK_ERROR_SZ, "Failed to write all bytes to output file. Error: %s", strerror(errno));
+        uo->has_callback_error = true;
+        PyErr_SetString(uo->error, uo->callback_error);
+        return NULL;
+    }
+    if (retval == ERAR_SUCCESS) {
+        if (uo->verify) return PyLong_FromUnsignedLong(uo->crc);
+        Py_RETURN_NONE;
+    }
+    convert_process_error(uo, retval);
     return NULL;
 }
 
+// Probing {{{
+static PyStructSequence_Field probe_fields[] = {
+    {(char*)"is_rar", (char*)"True if the file could be opened as a RAR archive"},
+    {(char*)"flags", (char*)"The ROADF_* archive flags"},
+    {(char*)"is_volume", (char*)"True if the archive is a volume of a multi-volume archive"},
+    {(char*)"is_first_volume", (char*)"True if the archive is the first volume"},
+    {(char*)"is_solid", (char*)"True for solid archives"},
+    {(char*)"is_locked", (char*)"True if the archive is locked"},
+    {(char*)"has_comment", (char*)"True if the archive has a comment"},
+    {(char*)"has_recovery_record", (char*)"True if the archive has a recovery record"},
+    {(char*)"encrypted_headers", (char*)"True if the file headers are encrypted, a password is needed to list the archive"},
+    {(char*)"encrypted", (char*)"True if the headers or the first file are encrypted"},
+    {NULL, NULL}
+};
 
-// Boilerplate {{{
-struct module_state {
-    PyObject *error;
+static PyStructSequence_Desc probe_desc = {
+    (char*)"unrar.ProbeResult", (char*)"The result of probe()", probe_fields, 10
 };
 
+static PyObject*
+probe(PyObject *self, PyObject *args) {
+    PyObject *path, *ans;
+    RAROpenArchiveDataEx open_info = {0};
+    RARHeaderDataEx header;
+    bool is_rar = true, encrypted = false;
+    unsigned int flags = 0, result;
+    if (!PyArg_ParseTuple(args, "O!", &PyUnicode_Type, &path)) return NULL;
+    wchar_t *pathbuf = unicode_to_wchar_alloc(path);
+    if (pathbuf == NULL) return NULL;
+    open_info.ArcNameW = pathbuf;
+    open_info.OpenMode = RAR_OM_LIST;
 
+    // No callback, so opening archives with encrypted headers fails with
+    // ERAR_MISSING_PASSWORD instead of asking for a password
+    Py_BEGIN_ALLOW_THREADS;
+    HANDLE data = RAROpenArchiveEx(&open_info);
+    result = data ? open_info.OpenResult : (open_info.OpenResult ? open_info.OpenResult : ERAR_EOPEN);
+    if (data) {
+        if (result == ERAR_SUCCESS) {
+            flags = open_info.Flags;
+            memset(&header, 0, sizeof(header));
+            if (RARReadHeaderEx(data, &header) == ERAR_SUCCESS) encrypted = (header.Flags & RHDF_ENCRYPTED) != 0;
+        }
+        RARCloseArchive(data);
+    }
+    Py_END_ALLOW_THREADS;
+    PyMem_Free(pathbuf);
 
-#if PY_MAJOR_VERSION >= 3
-#define GETSTATE(m) ((struct module_state*)PyModule_GetState(m))
-#else
-#define GETSTATE(m) (&_state)
-static struct module_state _state;
+    switch (result) {
+        case ERAR_SUCCESS: break;
+        case ERAR_MISSING_PASSWORD: flags = ROADF_ENCHEADERS; break;
+        case ERAR_BAD_ARCHIVE:
+        case ERAR_UNKNOWN_FORMAT:
+            is_rar = false; break;
+        default:
+            convert_rar_error(GETSTATE(self)->error, result);
+            return NULL;
+    }
+    if (flags & ROADF_ENCHEADERS) encrypted = true;
+    ans = PyStructSequence_New((PyTypeObject*)GETSTATE(self)->probe_result_type);
+    if (ans == NULL) return NULL;
+#define S(i, x) PyStructSequence_SET_ITEM(ans, i, x)
+#define F(i, x) S(i, PyBool_FromLong((flags & (x)) != 0))
+    S(0, PyBool_FromLong(is_rar));
+    S(1, PyLong_FromUnsignedLong(flags));
+    F(2, ROADF_VOLUME); F(3, ROADF_FIRSTVOLUME); F(4, ROADF_SOLID); F(5, ROADF_LOCK);
+    F(6, ROADF_COMMENT); F(7, ROADF_RECOVERY); F(8, ROADF_ENCHEADERS);
+    S(9, PyBool_FromLong(encrypted));
+#undef F
+#undef S
+    if (PyErr_Occurred()) { Py_DECREF(ans); return NULL; }
+    return ans;
+}
+// }}}
+
+// Password candidates {{{
+// Candidate passwords are tested without calling into python: every attempt
+// opens the archive with a callback that supplies the candidate, and either
+// the open (encrypted headers) or testing a single encrypted file tells
+// whether the candidate is correct.
+#define ENCRYPTED_HEADERS -1
+#define NOT_ENCRYPTED -2
+
+typedef struct {
+    const std::wstring *password;
+    unsigned int asks;
+} PasswordAttempt;
+
+static int CALLBACK
+password_callback(UINT msg, LPARAM user_data, LPARAM p1, LPARAM p2) {
+    PasswordAttempt *a = (PasswordAttempt*)user_data;
+    switch(msg) {
+        case UCM_CHANGEVOLUME:
+        case UCM_CHANGEVOLUMEW:
+            return p2 == RAR_VOL_NOTIFY ? 0 : -1;
+        case UCM_PROCESSDATA:
+            return 0;
+        case UCM_NEEDPASSWORDW:
+            // Multi-volume archives ask for each volume, guard against being
+            // asked forever for a wrong password
+            if (++a->asks > 64 || (size_t)(p2 & 0xffffffff) <= a->password->size()) return -1;
+            wcscpy(reinterpret_cast<wchar_t*>(p1), a->password->c_str());
+            return 0;
+    }
+    return -1;
+}
+
+// Find the file to test candidates against: the first encrypted file in solid
+// archives, since later files depend on it, otherwise the smallest one.
+static unsigned int
+find_password_target(const wchar_t *path, long *target) {
+    RAROpenArchiveDataEx open_info = {0};
+    RARHeaderDataEx header;
+    unsigned long long smallest = 0;
+    open_info.ArcNameW = (wchar_t*)path;
+    open_info.OpenMode = RAR_OM_LIST;
+    HANDLE data = RAROpenArchiveEx(&open_info);
+    if (!data) {
+        if (open_info.OpenResult == ERAR_MISSING_PASSWORD) { *target = ENCRYPTED_HEADERS; return ERAR_SUCCESS; }
+        return open_info.OpenResult ? open_info.OpenResult : ERAR_EOPEN;
+    }
+    unsigned int ret = open_info.OpenResult;
+    bool solid = (open_info.Flags & ROADF_SOLID) != 0;
+    *target = NOT_ENCRYPTED;
+    for (long i = 0; ret == ERAR_SUCCESS; i++) {
+        memset(&header, 0, sizeof(header));
+        ret = RARReadHeaderEx(data, &header);
+        if (ret != ERAR_SUCCESS) break;
+        unsigned long long size = combine(header.UnpSizeHigh, header.UnpSize);
+        if ((header.Flags & RHDF_ENCRYPTED) && !(header.Flags & (RHDF_DIRECTORY | RHDF_SPLITBEFORE)) && (*target < 0 || size < smallest)) {
+            *target = i; smallest = size;
+            if (solid) { ret = ERAR_END_ARCHIVE; break; }
+        }
+        ret = RARProcessFile(data, RAR_SKIP, NULL, NULL);
+    }
+    RARCloseArchive(data);
+    return ret == ERAR_END_ARCHIVE ? ERAR_SUCCESS : ret;
+}
+
+static bool
+password_matches(const wchar_t *path, const std::wstring &password, long target) {
+    PasswordAttempt a = {&password, 0};
+    RAROpenArchiveDataEx open_info = {0};
+    RARHeaderDataEx header;
+    open_info.ArcNameW = (wchar_t*)path;
+    open_info.OpenMode = RAR_OM_EXTRACT;
+    open_info.Callback = password_callback;
+    open_info.UserData = (LPARAM)&a;
+    HANDLE data = RAROpenArchiveEx(&open_info);
+    if (!data) return false;
+    unsigned int ret = open_info.OpenResult;
+    for (long i = 0; ret == ERAR_SUCCESS && i <= target; i++) {
+        memset(&header, 0, sizeof(header));
+        ret = RARReadHeaderEx(data, &header);
+        if (ret == ERAR_SUCCESS) ret = RARProcessFile(data, i == target ? RAR_TEST : RAR_SKIP, NULL, NULL);
+    }
+    RARCloseArchive(data);
+    return ret == ERAR_SUCCESS;
+}
+
+static PyObject*
+try_passwords(PyObject *self, PyObject *args) {
+    PyObject *path, *candidates, *seq;
+    unsigned int num_threads = 1, result;
+    long target = NOT_ENCRYPTED;
+    if (!PyArg_ParseTuple(args, "O!O|I", &PyUnicode_Type, &path, &candidates, &num_threads)) return NULL;
+    seq = PySequence_Fast(candidates, "candidates must be a sequence of strings");
+    if (seq == NULL) return NULL;
+    std::vector<std::wstring> passwords;
+    passwords.reserve(PySequence_Fast_GET_SIZE(seq));
+    for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+        PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+        wchar_t *pw = PyUnicode_Check(item) ? unicode_to_wchar_alloc(item) : NULL;
+        if (pw == NULL) {
+            if (!PyErr_Occurred()) PyErr_SetString(PyExc_TypeError, "candidates must be a sequence of strings");
+            Py_DECREF(seq); return NULL;
+        }
+        passwords.push_back(pw);
+        PyMem_Free(pw);
+    }
+    Py_DECREF(seq);
+    wchar_t *pathbuf = unicode_to_wchar_alloc(path);
+    if (pathbuf == NULL) return NULL;
+    const size_t none = passwords.size();
+    std::atomic<size_t> next(0), found(none);
+
+    Py_BEGIN_ALLOW_THREADS;
+    result = find_password_target(pathbuf, &target);
+    if (result == ERAR_SUCCESS && target != NOT_ENCRYPTED) {
+        // Candidates are handed out in order and only ones before the best
+        // match so far are tried, so the first matching candidate wins
+        auto worker = [&]() {
+            for (size_t i = next++; i < found.load(); i = next++) {
+                if (password_matches(pathbuf, passwords[i], target)) {
+                    size_t current = found.load();
+                    while (i < current && !found.compare_exchange_weak(current, i));
+                }
+            }
+        };
+        std::vector<std::thread> threads;
+        // Testing passwords is CPU bound, more threads than cores do not help
+        unsigned int max_threads = std::thread::hardware_concurrency();
+        if (!max_threads) max_threads = 8;
+        if (num_threads > max_threads) num_threads = max_threads;
+        try {
+            for (unsigned int i = 1; i < num_threads && i < passwords.size(); i++) threads.emplace_back(worker);
+        } catch (const std::exception&) {
+            // Carry on with the threads that were started
+        }
+        worker();
+        for (auto &t : threads) t.join();
+    }
+    Py_END_ALLOW_THREADS;
+    PyMem_Free(pathbuf);
+
+    if (result != ERAR_SUCCESS) { convert_rar_error(GETSTATE(self)->error, result); return NULL; }
+    if (target == NOT_ENCRYPTED) { PyErr_SetString(PyExc_ValueError, "The archive is not encrypted"); return NULL; }
+    if (found.load() == none) Py_RETURN_NONE;
+    return wchar_to_unicode(passwords[found.load()].data(), passwords[found.load()].size());
+}
+// }}}
+
+#ifndef _WIN32
+// Native extraction {{{
+// Convert a file name from the archive into a relative UTF-8 path with no
+// empty, . or .. components. Returns false if the path would end up outside
+// the destination directory, or be the destination directory itself.
+static bool
+sanitize_path(const std::string &utf8, std::string &ans) {
+    if (!utf8.empty() && utf8[0] == '/') return false;
+    std::vector<std::string> parts;
+    size_t pos = 0;
+    while (pos <= utf8.size()) {
+        size_t end = utf8.find('/', pos);
+        if (end == std::string::npos) end = utf8.size();
+        std::string component = utf8.substr(pos, end - pos);
+        if (component == "..") {
+            if (parts.empty()) return false;
+            parts.pop_back();
+        } else if (!component.empty() && component != ".") parts.push_back(component);
+        pos = end + 1;
+    }
+    if (parts.empty()) return false;
+    ans.clear();
+    for (size_t i = 0; i < parts.size(); i++) {
+        if (i) ans += '/';
+        ans += parts[i];
+    }
+    return true;
+}
+
+static bool
+sanitize_path(const wchar_t *name, size_t sz, std::string &ans) {
+    std::string utf8(4 * sz, 0);
+    utf8.resize(wchar_to_utf8(name, sz, &utf8[0]));
+    return sanitize_path(utf8, ans);
+}
+
+// Open directory fds below the destination directory, creating the
+// directories as needed. Every directory is created and opened once per
+// extraction, files are then opened with a single openat() relative to it.
+#define MAX_CACHED_DIRS 256
+
+struct DirCache {
+    int root;
+    std::unordered_map<std::string, int> fds;
+
+    DirCache(const std::string &base) : fds() {
+        root = open(base.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    ~DirCache() { clear(); if (root > -1) close(root); }
+
+    void clear() {
+        for (auto &x : fds) close(x.second);
+        fds.clear();
+    }
+
+    int lookup(const std::string &rel) {
+        if (rel.empty()) return root;
+        auto it = fds.find(rel);
+        if (it != fds.end()) return it->second;
+        size_t slash = rel.rfind('/');
+        int parent = slash == std::string::npos ? root : lookup(rel.substr(0, slash));
+        if (parent < 0) return -1;
+        const char *name = rel.c_str() + (slash == std::string::npos ? 0 : slash + 1);
+        if (mkdirat(parent, name, 0777) != 0 && errno != EEXIST) return -1;
+        int fd = openat(parent, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd > -1) fds[rel] = fd;
+        return fd;
+    }
+
+    // Returns the fd of the directory rel, creating it if needed, or -1 with errno set.
+    int get(const std::string &rel) {
+        if (fds.size() >= MAX_CACHED_DIRS && !fds.count(rel)) clear();
+        return lookup(rel);
+    }
+};
+
+static PyObject*
+extract_all(PyObject *self, PyObject *args) {
+    PyObject *file_capsule, *dest, *ans = NULL;
+    if (!PyArg_ParseTuple(args, "OO&", &file_capsule, PyUnicode_FSConverter, &dest)) return NULL;
+    const std::string base(PyBytes_AS_STRING(dest));
+    Py_DECREF(dest);
+    LOCK_HANDLE(file_capsule);
+    RARHeaderDataEx header;
+    HeaderRecord r;
+    std::unordered_set<std::string> seen;
+    std::unordered_map<std::wstring, uint32_t> crcs;
+    std::string rel, failed_path;
+    int err = 0;
+    unsigned int retval = ERAR_SUCCESS;
+
+    uo->zero_copy = false; uo->verify = true;
+    ALLOW_THREADS;
+    DirCache dirs(base);
+    if (dirs.root < 0) { err = errno; failed_path = base; }
+    else
+    while (true) {
+        memset(&header, 0, sizeof(header));
+        retval = read_header(uo, &header);
+        if (retval != ERAR_SUCCESS) break;
+        fill_record(&r, &header, uo->volume);
+        std::wstring name(r.filename, r.filename_sz);
+        bool is_file = !(r.flags & RHDF_DIRECTORY) && !r.redir_type;
+        bool is_safe = r.filename_sz && sanitize_path(r.filename, r.filename_sz, rel);
+        if (!is_safe || !is_file) {
+            if (r.flags & RHDF_DIRECTORY) {
+                // We ignore create directory errors since we dont care about missing empty dirs
+                if (is_safe) dirs.get(rel);
+                crcs.erase(name);
+            } else if (r.redir_type) crcs.erase(name);
+            retval = process_member(uo, RAR_SKIP);
+            if (retval != ERAR_SUCCESS) break;
+            continue;
+        }
+        size_t slash = rel.rfind('/');
+        int dir_fd = dirs.get(slash == std::string::npos ? std::string() : rel.substr(0, slash));
+        if (dir_fd < 0) { err = errno; failed_path = base + '/' + rel.substr(0, slash); break; }
+        bool append = seen.count(rel) > 0;
+        int fd = openat(dir_fd, rel.c_str() + (slash == std::string::npos ? 0 : slash + 1),
+                O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC), 0666);
+        if (fd < 0) { err = errno; failed_path = base + '/' + rel; break; }
+        seen.insert(rel);
+        uo->output_fd = fd;
+        uo->crc = crcs.count(name) ? crcs[name] : 0;
+        bool sink_ok;
+        {
+            ScopedTimer timer(&uo->stats.process_ns);
+            sink_start(uo, r.unpack_size < (1ull << 62) ? (long long)r.unpack_size : -1);
+            retval = process_member(uo, RAR_TEST);
+            sink_ok = sink_finish(uo);
+        }
+        uo->stats.files++;
+        if (retval == ERAR_SUCCESS && !sink_ok) {
+            snprintf(uo->callback_error, CALLBACK_ERROR_SZ, "Failed to write all bytes to output file. Error: %s", strerror(errno));
+            uo->has_callback_error = true;
+            retval = ERAR_UNKNOWN;
+        }
+        if (retval == ERAR_SUCCESS) {
+            struct timespec times[2];
+            times[0].tv_sec = times[1].tv_sec = r.file_time; times[0].tv_nsec = times[1].tv_nsec = 0;
+            futimens(fd, times);
+        }
+        close(fd);
+        uo->output_fd = -1;
+        if (retval != ERAR_SUCCESS) break;
+        crcs[name] = uo->crc;
+    }
+    BLOCK_THREADS;
+    uo->verify = false;
+
+    if (!failed_path.empty()) {
+        errno = err;
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, failed_path.c_str());
+    } else if (retval != ERAR_END_ARCHIVE) convert_process_error(uo, retval);
+    else if ((ans = PyDict_New())) {
+        for (auto &x : crcs) {
+            PyObject *k = wchar_to_unicode(x.first.data(), x.first.size()), *v = PyLong_FromUnsignedLong(x.second);
+            int ok = k && v ? PyDict_SetItem(ans, k, v) : -1;
+            Py_XDECREF(k); Py_XDECREF(v);
+            if (ok != 0) { Py_CLEAR(ans); break; }
+        }
+    }
+    return ans;
+}
+// }}}
 #endif
 
+// Boilerplate {{{
+
 static PyMethodDef methods[] = {
     {"open_archive", (PyCFunction)open_archive, METH_VARARGS,
-        "open_archive(path, callback, mode=RAR_OM_LIST)\n\nOpen the RAR archive at path. By default opens for listing, use mode to change that."
+        "open_archive(path, callback, mode=RAR_OM_LIST, get_comment=False, blocking=True)\n\nOpen the RAR archive at path. By default opens for listing, use mode to change that."
+        " Calls on the returned handle from different threads are serialized, if blocking is False a call while another thread is using the handle"
+        " raises RuntimeError instead of waiting."
+    },
+    {"set_filter", (PyCFunction)set_filter, METH_VARARGS,
+        "set_filter(capsule, names=None, globs=None, min_size=0, max_size=2**64-1, skip_dirs=False, skip_links=False)\n\n"
+        "Select the members of the archive natively, members that do not match are skipped without calling python, by all functions that read headers."
+        " A member matches if its unpacked size is in [min_size, max_size], it is not excluded by skip_dirs or skip_links (which exclude symlinks and"
+        " other redirections) and its name, with / as the separator, is in names or matches one of the fnmatch style globs. If both names and globs"
+        " are None the name is not checked. Call with only capsule to remove the filter."
+    },
+    {"clone", (PyCFunction)clone, METH_VARARGS,
+        "clone(capsule, callback)\n\nOpen the archive of capsule again, with the same mode, and position the new handle at the current member of capsule,"
+        " by skipping the members before it. If a header has been read on capsule but not yet processed, it is read on the new handle too, so that"
+        " process_file() can be called on it next. The new handle is independent of capsule and can be used from another thread."
     },
 
     {"close_archive", (PyCFunction)close_archive, METH_O,
-        "close_archive(capsule)\n\nClose the specified archive."
+        "close_archive(capsule)\n\nClose the specified archive. Closing an archive that is already closed does nothing."
+    },
+
+    {"archive_info", (PyCFunction)archive_info, METH_O,
+        "archive_info(capsule)\n\nReturn a dict with the archive level flags reported when the archive was opened and the number of volumes changed to so far"
     },
 
     {"read_next_header", (PyCFunction)read_next_header, METH_O,
         "read_next_header(capsule)\n\nRead the next header from the RAR archive"
     },
 
+    {"read_all_headers", (PyCFunction)read_all_headers, METH_O,
+        "read_all_headers(capsule)\n\nRead all remaining headers from the RAR archive, skipping the files, and return them as a list"
+    },
+
+    {"read_header_table", (PyCFunction)read_header_table, METH_O,
+        "read_header_table(capsule)\n\nRead all remaining headers from the RAR archive, skipping the files, and return them in columnar form"
+        " as (columns, names, name_offsets). columns is a dict of typed memoryviews, names is the UTF-8 encoded file names concatenated"
+        " and name_offsets is a memoryview of count + 1 offsets into names."
+    },
+
+    {"skip_headers", (PyCFunction)skip_headers, METH_VARARGS,
+        "skip_headers(capsule, count)\n\nSkip the next count files in the archive without creating any python objects. Returns the number of files skipped."
+    },
+
+    {"set_output_buffer", (PyCFunction)set_output_buffer, METH_VARARGS,
+        "set_output_buffer(capsule, buffer=None, offset=0)\n\nRegister a writable buffer into which process_file() copies the data, starting at offset,"
+        " instead of calling the callback. Any previously registered buffer is released and the offset just past the last byte written into"
+        " it is returned, or None if there was no buffer."
+    },
+
+    {"set_output_bytes", (PyCFunction)set_output_bytes, METH_VARARGS,
+        "set_output_bytes(capsule, size)\n\nLike set_output_buffer() with a new bytes object of the specified size, which is returned, so that"
+        " data can be decompressed into an immutable object without copying it. Its contents are only valid once set_output_buffer(capsule)"
+        " has been called and has returned size."
+    },
+
+    {"set_output_options", (PyCFunction)set_output_options, METH_VARARGS,
+        "set_output_options(capsule, buffer_size=0, flags=0)\n\nControl how data is written to the output_fd passed to process_file().\n"
+        "buffer_size: Gather data into writes of this size, rounded up to a multiple of 4096. Zero means write every chunk as it arrives.\n"
+        "flags: OUTPUT_DIRECT to use direct I/O (needs buffer_size), OUTPUT_DROP_CACHE to drop the written data from the page cache (where supported, not on macOS) and"
+        " OUTPUT_WRITE_BEHIND to write full buffers from a separate thread while the next buffer is filled (needs buffer_size)."
+    },
+
+    {"set_name_options", (PyCFunction)set_name_options, METH_VARARGS,
+        "set_name_options(capsule, flags=0)\n\nControl how the names of files are returned by the functions reading headers.\n"
+        "flags: NAMES_NORMALIZE to use / as the path separator on Windows as well and NAMES_INTERN to make read_header_table()"
+        " store every distinct directory once, returning (columns, names_blob, name_offsets, dirs), where the names_blob has only"
+        " the part of each name after the directory, dirs is a list of the directories, ending with a separator, and columns['dir']"
+        " has the index into dirs for each file, zero for files that are not in a directory."
+    },
+
+    {"probe", (PyCFunction)probe, METH_VARARGS,
+        "probe(path)\n\nQuickly check the file at path, returning a ProbeResult with the archive level flags. No callbacks are used, so archives with encrypted headers show up as encrypted_headers=True with no other flags set. Raises an error if the file cannot be opened."
+    },
+
+    {"try_passwords", (PyCFunction)try_passwords, METH_VARARGS,
+        "try_passwords(path, candidates, threads=1)\n\nTest the candidate passwords against the archive at path, using the specified number of threads, at most one per CPU. Returns the first candidate that is correct or None if none are."
+    },
+
+#ifndef _WIN32
+    {"extract_all", (PyCFunction)extract_all, METH_VARARGS,
+        "extract_all(capsule, dest_dir)\n\nExtract all remaining files into dest_dir, natively and with the GIL released. Output is written"
+        " as configured by set_output_options(). Files whose paths would end up outside dest_dir are skipped. Returns a dict mapping file"
+        " names to CRC32s."
+    },
+#endif
+
+    {"stats", (PyCFunction)stats, METH_VARARGS,
+        "stats(capsule=None, reset=False)\n\nReturn a dict of counters for the handle: bytes_out, chunks, files, volume_changes, chunk_histogram (bucket i counts chunks smaller than 1024 << i, the last bucket all larger ones), "
+        "process_ns (time in RARProcessFile), its parts decompress_ns, sink_ns (writing to output files) and callback_ns (running python callbacks), gil_acquisitions and gil_wait_ns. "
+        "With no capsule, return the aggregate for all handles closed so far. If reset is True the counters are zeroed after being read."
+    },
+
+    {"set_callback_buffer", (PyCFunction)set_callback_buffer, METH_VARARGS,
+        "set_callback_buffer(capsule, size=0)\n\nGather the data passed to the _process_data() method of the callback into chunks of up to size bytes, so that it is called less often. "
+        "Gathered data is delivered when the buffer is full and when the member ends. Zero means call it for every chunk as unrar produces it."
+    },
+
     {"process_file", (PyCFunction)process_file, METH_VARARGS,
-        "process_file(capsule, operation=RAR_TEST)\n\nProcess the current file. The callback registered in open_archive will be called."
+        "process_file(capsule, operation=RAR_TEST, output_fd=-1, zero_copy=False, crc=None, size=-1)\n\nProcess the current file. The callback registered in open_archive will be called."
+        " If output_fd is specified data is written to it instead. If zero_copy is True, the callback is passed a read-only"
+        " memoryview that is valid only for the duration of the call, instead of a bytes object. If crc is not None"
+        " the CRC32 of the data, starting from the value of crc, is calculated natively and returned. size is the expected size of the"
+        " data, used to preallocate space in output_fd."
     },
 
     {NULL, NULL}
 };
 
-#if PY_MAJOR_VERSION >= 3
+static int
+exec_module(PyObject *module) {
+    struct module_state *st = GETSTATE(module);
+    std::call_once(crc_table_initialized, init_crc_table);
+
+    st->error = PyErr_NewException((char*)"unrar.UNRARError", NULL, NULL);
+    if (st->error == NULL) return -1;
+    Py_INCREF(st->error);
+    if (PyModule_AddObject(module, "UNRARError", st->error) != 0) { Py_DECREF(st->error); return -1; }
+    if (PyModule_AddIntConstant(module, "RARDllVersion",  RARGetDllVersion()) != 0) { return -1; }
+    if (PyModule_AddIntMacro(module, RAR_OM_LIST) != 0) { return -1; }
+    if (PyModule_AddIntMacro(module, RAR_OM_EXTRACT) != 0) { return -1; }
+    if (PyModule_AddIntMacro(module, RAR_OM_LIST_INCSPLIT) != 0) { return -1; }
+    if (PyModule_AddIntMacro(module, RAR_SKIP) != 0) { return -1; }
+    if (PyModule_AddIntMacro(module, RAR_EXTRACT) != 0) { return -1; }
+    if (PyModule_AddIntMacro(module, RAR_TEST) != 0) { return -1; }
+    if (PyModule_AddIntMacro(module, OUTPUT_DIRECT) != 0) { return -1; }
+    if (PyModule_AddIntMacro(module, OUTPUT_DROP_CACHE) != 0) { return -1; }
+    if (PyModule_AddIntMacro(module, OUTPUT_WRITE_BEHIND) != 0) { return -1; }
+    if (PyModule_AddIntMacro(module, NAMES_NORMALIZE) != 0) { return -1; }
+    if (PyModule_AddIntMacro(module, NAMES_INTERN) != 0) { return -1; }
+    if (PyModule_AddIntMacro(module, RHDF_SPLITBEFORE) != 0) { return -1; }
+    if (PyModule_AddIntMacro(module, RHDF_SPLITAFTER) != 0) { return -1; }
+    if (PyModule_AddIntMacro(module, RHDF_ENCRYPTED) != 0) { return -1; }
+    if (PyModule_AddIntMacro(module, RHDF_SOLID) != 0) { return -1; }
+    if (PyModule_AddIntMacro(module, RHDF_DIRECTORY) != 0) { return -1; }
+    if (PyModule_AddIntMacro(module, ROADF_VOLUME) != 0) { return -1; }
+    if (PyModule_AddIntMacro(module, ROADF_COMMENT) != 0) { return -1; }
+    if (PyModule_AddIntMacro(module, ROADF_LOCK) != 0) { return -1; }
+    if (PyModule_AddIntMacro(module, ROADF_SOLID) != 0) { return -1; }
+    if (PyModule_AddIntMacro(module, ROADF_NEWNUMBERING) != 0) { return -1; }
+    if (PyModule_AddIntMacro(module, ROADF_SIGNED) != 0) { return -1; }
+    if (PyModule_AddIntMacro(module, ROADF_RECOVERY) != 0) { return -1; }
+    if (PyModule_AddIntMacro(module, ROADF_ENCHEADERS) != 0) { return -1; }
+    if (PyModule_AddIntMacro(module, ROADF_FIRSTVOLUME) != 0) { return -1; }
+    st->probe_result_type = (PyObject*)PyStructSequence_NewType(&probe_desc);
+    if (st->probe_result_type == NULL) return -1;
+    Py_INCREF(st->probe_result_type);
+    if (PyModule_AddObject(module, "ProbeResult", st->probe_result_type) != 0) { Py_DECREF(st->probe_result_type); return -1; }
+    return 0;
+}
 
 static int
 traverse(PyObject *m, visitproc visit, void *arg) {
     Py_VISIT(GETSTATE(m)->error);
+    Py_VISIT(GETSTATE(m)->probe_result_type);
     return 0;
 }
 
 static int
 clear(PyObject *m) {
     Py_CLEAR(GETSTATE(m)->error);
+    Py_CLEAR(GETSTATE(m)->probe_result_type);
     return 0;
 }
 
+// The module keeps no global python objects and handles are locked, so it can
+// be loaded in sub-interpreters with their own GIL and in free-threaded builds
+static PyModuleDef_Slot slots[] = {
+    {Py_mod_exec, (void*)exec_module},
+#ifdef Py_mod_multiple_interpreters
+    {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+#ifdef Py_mod_gil
+    {Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+    {0, NULL}
+};
 
 static struct PyModuleDef moduledef = {
         PyModuleDef_HEAD_INIT,
@@ -443,50 +2212,14 @@ static struct PyModuleDef moduledef = {
         NULL,
         sizeof(struct module_state),
         methods,
-        NULL,
+        slots,
         traverse,
         clear,
         NULL
 };
 
-#define INITERROR return NULL
-
-PyMODINIT_FUNC
-PyInit_unrar(void)
-
-#else
-#define INITERROR return
-
 PyMODINIT_FUNC
-initunrar(void)
-#endif
-{
-#if PY_MAJOR_VERSION >= 3
-    PyObject *module = PyModule_Create(&moduledef);
-#else
-    PyObject *module = Py_InitModule("unrar", methods);
-#endif
-
-    if (module == NULL) { INITERROR; }
-    struct module_state *st = GETSTATE(module);
-
-    st->error = PyErr_NewException((char*)"unrar.UNRARError", NULL, NULL);
-    if (st->error == NULL) {
-        Py_DECREF(module);
-        INITERROR;
-    }
-    UNRARError = st->error;
-    if (PyModule_AddObject(module, "UNRARError", UNRARError) != 0) { INITERROR;}
-    if (PyModule_AddIntConstant(module, "RARDllVersion",  RARGetDllVersion()) != 0) { INITERROR; }
-    if (PyModule_AddIntMacro(module, RAR_OM_LIST) != 0) { INITERROR; }
-    if (PyModule_AddIntMacro(module, RAR_OM_EXTRACT) != 0) { INITERROR; }
-    if (PyModule_AddIntMacro(module, RAR_OM_LIST_INCSPLIT) != 0) { INITERROR; }
-    if (PyModule_AddIntMacro(module, RAR_SKIP) != 0) { INITERROR; }
-    if (PyModule_AddIntMacro(module, RAR_EXTRACT) != 0) { INITERROR; }
-    if (PyModule_AddIntMacro(module, RAR_TEST) != 0) { INITERROR; }
-
-#if PY_MAJOR_VERSION >= 3
-    return module;
-#endif
+PyInit_unrar(void) {
+    return PyModuleDef_Init(&moduledef);
 }
 // }}}
@@ -11,9 +11,10 @@ import unittest
 from binascii import crc32
 
 from unrardll import (
-    BadPassword, PasswordRequired, comment, extract, extract_member, extract_members, headers, names,
-    open_archive, unrar, make_long_path_useable
+    BadPassword, PasswordRequired, archive_index, comment, extract, extract_member, extract_members, header_table,
+    headers, list_headers, names, open_archive, open_member, unrar, make_long_path_useable
 )
+import unrardll
 
 from . import TempDir, TestCase, base
 
@@ -69,6 +70,68 @@ class BasicTests(TestCase):
         all_names.remove('symlink'), all_names.remove('1'), all_names.remove('2')
         self.ae(all_names, list(names(simple_rar, only_useful=True)))
 
+    def test_member_filter(self):
+        from unrardll import MemberFilter as F
+
+        def n(**kw):
+            return list(names(simple_rar, member_filter=F(**kw)))
+        self.ae(n(dirs=False, links=False), list(names(simple_rar, only_useful=True)))
+        self.ae(n(names=['one.txt', 'missing']), ['one.txt'])
+        self.ae(n(globs=['*.txt']), ['one.txt', '诶比屁.txt', 'Füße.txt', '2/sub-two.txt'])
+        self.ae(n(names=['uncompressed'], globs=['[12]', '?/sub-o*']), ['1/sub-one', '1', '2', 'uncompressed'])
+        self.ae(n(names=[]), [])
+        self.ae(n(min_size=5, max_size=9, links=False), [k for k in names(simple_rar) if 5 <= len(sr_data[k]) <= 9 and k != 'symlink'])
+        self.ae(len(header_table(simple_rar, member_filter=F(globs=['*.txt']))), 4)
+        self.ae(extract_member(simple_rar, None, member_filter=F(globs=['*one*'], dirs=False)), ('1/sub-one', sr_data['1/sub-one']))
+        data, current = {}, []
+
+        def callback(x):
+            if isinstance(x, dict):
+                current.append(x['filename'])
+                data[current[-1]] = b''
+                return True
+            data[current[-1]] += x
+        extract_members(simple_rar, callback, member_filter=F(names=['one.txt', 'max-compressed']))
+        self.ae(data, {k: sr_data[k] for k in ('one.txt', 'max-compressed')})
+        with TempDir() as tdir:
+            extract(simple_rar, tdir, verify_data=True, member_filter=F(globs=['2/*']))
+            self.ae(os.listdir(tdir), ['2'])
+            self.ae(os.listdir(os.path.join(tdir, '2')), ['sub-two.txt'])
+
+    def test_read_all_headers(self):
+        with open_archive(simple_rar, None) as f:
+            all_headers = unrar.read_all_headers(f)
+        expected = []
+        with open_archive(simple_rar, None) as f:
+            while True:
+                h = unrar.read_next_header(f)
+                if h is None:
+                    break
+                expected.append(h)
+                unrar.process_file(f, unrar.RAR_SKIP)
+        self.ae(all_headers, expected)
+        self.ae(list(headers(simple_rar)), expected)
+        self.ae(list_headers(simple_rar), expected)
+
+    def test_header_table(self):
+        t = header_table(simple_rar)
+        all_headers = list(headers(simple_rar))
+        self.ae(len(t), len(all_headers))
+        self.ae(list(t.names()), [h['filename'] for h in all_headers])
+        for k in ('pack_size', 'unpack_size', 'file_crc', 'file_time', 'flags', 'file_attr', 'method', 'redir_type', 'volume'):
+            self.ae(t[k].tolist(), [h[k] for h in all_headers], k)
+
+    def test_name_options(self):
+        expected = [h['filename'].replace(os.sep, '/') for h in headers(simple_rar)]
+        self.ae([h['filename'] for h in headers(simple_rar, normalize_names=True)], expected)
+        self.ae(list(names(simple_rar)), expected)
+        t = header_table(simple_rar, normalize_names=True, intern_dirs=True)
+        self.ae(list(t.names()), expected)
+        self.ae(len(t.names_blob), sum(len(x.rpartition('/')[2].encode('utf-8')) for x in expected))
+        self.ae(t.dirs[0], '')
+        self.ae(sorted(t.dirs[1:]), sorted({x.rpartition('/')[0] + '/' for x in expected if '/' in x}))
+        self.ae(len(t['dir']), len(expected))
+
     def test_comment(self):
         self.ae(comment(simple_rar), 'some comment\n')
         self.ae(comment(password_rar), '')
@@ -100,6 +163,424 @@ class BasicTests(TestCase):
             del q['symlink']
             self.ae(data, q)
 
+    def test_resumable_extract(self):
+        orig = unrardll._extract_one
+        for v in (True, False):
+            with TempDir() as tdir:
+                seen = []
+
+                def interrupt(f, archive_path, c, location, h, *args):
+                    if len(seen) == 2:
+                        raise KeyboardInterrupt()
+                    seen.append(h['filename'])
+                    return orig(f, archive_path, c, location, h, *args)
+
+                unrardll._extract_one = interrupt
+                try:
+                    self.assertRaises(KeyboardInterrupt, unrardll.extract_resumable, simple_rar, tdir, verify_data=v)
+                finally:
+                    unrardll._extract_one = orig
+                journal = os.path.join(tdir, '.unrardll-journal')
+                self.ae(len(open(journal, 'rb').read().splitlines()), 3)
+                unrardll.extract_resumable(simple_rar, tdir, verify_data=v)
+                self.assertFalse(os.path.exists(journal))
+                data = {}
+                for dirpath, dirnames, filenames in os.walk(tdir):
+                    for f in filenames:
+                        path = normalize(os.path.join(dirpath, f))
+                        data[os.path.relpath(path, tdir).replace(os.sep, '/')] = open(path, 'rb').read()
+            q = {k: v for k, v in sr_data.items() if v}
+            del q['symlink']
+            self.ae(data, q)
+
+    def test_probe(self):
+        from unrardll import probe
+        p = probe(simple_rar)
+        self.assertTrue(p.is_rar)
+        self.assertFalse(p.is_volume or p.is_solid or p.encrypted or p.encrypted_headers)
+        p = probe(password_rar)
+        self.assertTrue(p.encrypted)
+        self.assertFalse(p.encrypted_headers)
+        parts = [os.path.join(base, 'example_split_archive.part%d.rar' % i) for i in (1, 2)]
+        self.ae([(p.is_volume, p.is_first_volume) for p in map(probe, parts)], [(True, True), (True, False)])
+        self.assertTrue(probe(parts[1]).flags & unrar.ROADF_VOLUME)
+        self.assertFalse(probe(os.path.join(base, 'basic.py')).is_rar)
+
+    def test_archive_info(self):
+        from unrardll import read_archive
+        with open_archive(simple_rar, unrardll.Callback()) as f:
+            info = unrar.archive_info(f)
+        self.ae(info['flags'], 0)
+        self.assertFalse(info['is_solid'])
+        info, hs = read_archive(os.path.join(base, 'example_split_archive.part1.rar'))
+        self.assertTrue(info['is_volume'] and info['is_first_volume'])
+        self.ae(info['volume'], 0)
+        self.ae(hs, list(headers(os.path.join(base, 'example_split_archive.part1.rar'))))
+
+    def test_try_passwords(self):
+        from unrardll import try_passwords
+        candidates = ['a', 'sfasgsfdg', 'example', 'b', 'example']
+        for threads in (1, 3):
+            self.ae(try_passwords(password_rar, candidates, threads), 'example')
+            self.assertIsNone(try_passwords(password_rar, candidates[:2], threads))
+        self.assertIsNone(try_passwords(password_rar, []))
+        self.assertRaises(ValueError, try_passwords, simple_rar, candidates)
+
+    def test_password_cache(self):
+        class C(unrardll.Callback):
+            calls = 0
+
+            def _get_password(self):
+                self.calls += 1
+                return unrardll.Callback._get_password(self)
+
+            def _process_data(self, data):
+                return True
+
+        c = C(pw='example')
+        with open_archive(password_rar, c, mode=unrar.RAR_OM_EXTRACT) as f:
+            while unrar.read_next_header(f) is not None:
+                unrar.process_file(f, unrar.RAR_TEST)
+        self.ae(c.calls, 1)
+        c = C(pw='sfasgsfdg')
+        with open_archive(password_rar, c, mode=unrar.RAR_OM_EXTRACT) as f:
+            h = unrar.read_next_header(f)
+            while h is not None and not h['flags'] & unrar.RHDF_ENCRYPTED:
+                unrar.process_file(f, unrar.RAR_TEST)
+                h = unrar.read_next_header(f)
+            self.assertRaises(unrar.UNRARError, unrar.process_file, f, unrar.RAR_TEST)
+            self.ae(c.calls, 1)
+
+    def test_volume_resolver(self):
+        import shutil
+
+        class Resolver(unrardll.VolumeResolver):
+            def __init__(self):
+                self.found, self.opened_volumes = [], []
+
+            def find(self, path):
+                self.found.append(os.path.basename(path))
+                return os.path.join(base, os.path.basename(path))
+
+            def opened(self, path):
+                self.opened_volumes.append(os.path.basename(path))
+
+        with TempDir() as tdir:
+            src, expected, actual = (os.path.join(tdir, x) for x in 'src expected actual'.split())
+            for x in (src, expected, actual):
+                os.mkdir(x)
+            first = os.path.join(src, 'example_split_archive.part1.rar')
+            shutil.copy2(os.path.join(base, 'example_split_archive.part1.rar'), first)
+            self.assertRaises(unrar.UNRARError, extract, first, actual)
+
+            class TooLong(unrardll.VolumeResolver):
+                def find(self, path):
+                    return os.path.join(base, 'x' * 4096, os.path.basename(path))
+
+            with self.assertRaisesRegex(unrar.UNRARError, 'longer than'):
+                extract(first, actual, volume_resolver=TooLong())
+            extract(os.path.join(base, 'example_split_archive.part1.rar'), expected)
+            r = Resolver()
+            extract(first, actual, volume_resolver=r, verify_data=True)
+            self.ae(r.found[:2], ['example_split_archive.part2.rar', 'example_split_archive.part3.rar'])
+            self.ae(r.opened_volumes[:2], r.found[:2])
+            for dirpath, dirnames, filenames in os.walk(expected):
+                for f in filenames:
+                    path = os.path.join(dirpath, f)
+                    with open(path, 'rb') as a, open(os.path.join(actual, os.path.relpath(path, expected)), 'rb') as b:
+                        self.ae(a.read(), b.read())
+
+            # Resuming reads the index and skips through the volumes, both need the resolver
+            resumed = os.path.join(tdir, 'resumed')
+            os.mkdir(resumed)
+            orig = unrardll.verify
+
+            def interrupt(*args, **kw):
+                raise KeyboardInterrupt()
+
+            unrardll.verify = interrupt
+            try:
+                self.assertRaises(
+                    KeyboardInterrupt, unrardll.extract_resumable, first, resumed, verify_data=True, volume_resolver=Resolver())
+            finally:
+                unrardll.verify = orig
+            journal = os.path.join(resumed, '.unrardll-journal')
+            self.assertTrue(os.path.exists(journal))
+            unrardll.extract_resumable(first, resumed, verify_data=True, volume_resolver=Resolver())
+            self.assertFalse(os.path.exists(journal))
+            self.ae(sorted(os.listdir(resumed)), sorted(os.listdir(expected)))
+
+    def test_callback_buffer(self):
+        def read_chunks(size):
+            chunks = {}
+            c = unrardll.ExtractCallback()
+            with open_archive(simple_rar, c, mode=unrar.RAR_OM_EXTRACT) as f:
+                self.assertRaises(ValueError, unrar.set_callback_buffer, f, -1)
+                unrar.set_callback_buffer(f, size)
+                while True:
+                    h = unrar.read_next_header(f)
+                    if h is None:
+                        break
+                    chunks[h['filename']] = q = []
+                    c.reset(write=lambda data: q.append(bytes(data)))
+                    unrar.process_file(f, unrar.RAR_TEST)
+            return chunks
+
+        unbuffered = read_chunks(0)
+        for size in (1, 7, 1024 * 1024):
+            chunks = read_chunks(size)
+            self.ae({k: b''.join(v) for k, v in chunks.items()}, {k: b''.join(v) for k, v in unbuffered.items()})
+            self.assertLessEqual(sum(map(len, chunks.values())), sum(map(len, unbuffered.values())))
+        self.assertTrue(all(len(v) <= 1 for v in read_chunks(1024 * 1024).values()))
+
+    def test_stats(self):
+        before = unrar.stats()
+        c = unrardll.ExtractCallback()
+        data, files = [], 0
+        with open_archive(simple_rar, c, mode=unrar.RAR_OM_EXTRACT) as f:
+            while True:
+                h = unrar.read_next_header(f)
+                if h is None:
+                    break
+                c.reset(write=data.append)
+                unrar.process_file(f, unrar.RAR_TEST)
+                files += 1
+            s = unrar.stats(f)
+            self.ae(s['bytes_out'], sum(map(len, data)))
+            self.ae(s['files'], files)
+            self.ae(sum(s['chunk_histogram']), s['chunks'])
+            self.assertGreaterEqual(s['process_ns'], s['decompress_ns'])
+            self.assertGreater(s['gil_acquisitions'], 0)
+            unrar.stats(f, True)
+            self.ae(unrar.stats(f)['bytes_out'], 0)
+            unrar.stats(f)
+        after = unrar.stats()
+        self.ae(after['files'] - before['files'], 0)
+        with open_archive(simple_rar, unrardll.Callback(), mode=unrar.RAR_OM_EXTRACT) as f:
+            unrar.read_next_header(f)
+            unrar.process_file(f, unrar.RAR_SKIP)
+        self.ae(unrar.stats()['files'], after['files'])
+
+    def test_destination(self):
+        with TempDir() as tdir:
+            d = unrardll.Destination(tdir)
+            base = os.path.abspath(tdir)
+            self.ae(d.path('a/b/c'), os.path.join(base, 'a', 'b', 'c'))
+            self.ae(d.path('a/b/d'), os.path.join(base, 'a', 'b', 'd'))
+            self.ae(d.path('x'), os.path.join(base, 'x'))
+            for unsafe in ('../x', 'a/../../x', '/x', '.', 'a/..'):
+                self.assertIsNone(d.path(unsafe), unsafe)
+            self.assertIn('a/b', d.dirs)
+            d.ensure_dir(os.path.join(base, 'a', 'b'))
+            d.ensure_dir(os.path.join(base, 'a', 'b'))
+            self.assertTrue(os.path.isdir(os.path.join(base, 'a', 'b')))
+
+    def test_extract_all(self):
+        if not hasattr(unrar, 'extract_all'):
+            raise unittest.SkipTest('extract_all() is not available')
+        with TempDir() as native, TempDir() as python:
+            with open_archive(simple_rar, unrardll.ExtractCallback(), mode=unrar.RAR_OM_EXTRACT) as f:
+                crc_map = unrar.extract_all(f, native)
+            c = unrardll.ExtractCallback(verify_data=True)
+            with open_archive(simple_rar, c, mode=unrar.RAR_OM_EXTRACT) as f:
+                self.ae(crc_map, dict(unrardll._extract(f, simple_rar, c, python)))
+            for dirpath, dirnames, filenames in os.walk(python):
+                for f in filenames:
+                    path = os.path.join(dirpath, f)
+                    q = os.path.join(native, os.path.relpath(path, python))
+                    with open(path, 'rb') as a, open(q, 'rb') as b:
+                        self.ae(a.read(), b.read())
+                    self.ae(os.path.getmtime(path), os.path.getmtime(q))
+
+    def test_batch_extractor(self):
+        from unrardll import BatchExtractor
+        with TempDir() as tdir:
+            dests = [os.path.join(tdir, str(i)) for i in range(4)]
+            for d in dests:
+                os.mkdir(d)
+            with BatchExtractor(threads=2, max_pending=1) as b:
+                ids = [b.submit(simple_rar, d) for d in dests[:2]]
+                ids.append(b.submit(os.path.join(tdir, 'missing.rar'), dests[2]))
+                ids.append(b.submit(password_rar, dests[3]))
+                self.ae(ids, list(range(4)))
+                self.ae(sorted(r.job_id for r in b.results()), ids)
+                results = b.join()
+            self.ae([r.job_id for r in results], ids)
+            self.ae([r.error is None for r in results], [True, True, False, False])
+            self.assertIsInstance(results[3].error, PasswordRequired)
+            for d in dests[:2]:
+                self.ae(sorted(os.listdir(d)), sorted(os.listdir(dests[0])))
+            self.assertTrue(os.listdir(dests[0]))
+            self.assertRaises(RuntimeError, b.submit, simple_rar, dests[0])
+
+    def test_shared_handle(self):
+        import threading
+        seen = []
+
+        def worker(f):
+            while True:
+                h = unrar.read_next_header(f)
+                if h is None:
+                    break
+                seen.append(h['filename'])
+
+        with open_archive(simple_rar, unrardll.Callback()) as f:
+            threads = [threading.Thread(target=worker, args=(f,)) for i in range(4)]
+            for t in threads:
+                t.start()
+            for t in threads:
+                t.join()
+        self.ae(sorted(seen), sorted(names(simple_rar)))
+        self.assertRaises(ValueError, unrar.read_next_header, f)
+        self.assertIsNone(unrar.close_archive(f))
+
+        class Callback(unrardll.Callback):
+
+            def _process_data(self, data):
+                self.assertRaises(RuntimeError, unrar.stats, self.f)
+                return True
+
+        c = Callback()
+        c.assertRaises = self.assertRaises
+        with open_archive(simple_rar, c, mode=unrar.RAR_OM_EXTRACT) as c.f:
+            unrar.read_next_header(c.f)
+            unrar.process_file(c.f)
+
+    def test_clone(self):
+        all_names = list(names(simple_rar))
+        with open_archive(simple_rar, unrardll.Callback(), mode=unrar.RAR_OM_EXTRACT, blocking=False) as f:
+            for i in range(3):
+                unrar.read_next_header(f)
+                unrar.process_file(f, unrar.RAR_SKIP)
+            g = unrar.clone(f, unrardll.Callback())
+            self.ae(unrar.read_next_header(g)['filename'], all_names[3])
+            self.ae(unrar.read_next_header(f)['filename'], all_names[3])
+            c = unrardll.ExtractCallback()
+            data = []
+            c.reset(write=data.append)
+            h = unrar.clone(f, c)
+            unrar.process_file(h, unrar.RAR_TEST)
+            self.ae(b''.join(data), sr_data[all_names[3]])
+            for x in (g, h):
+                unrar.close_archive(x)
+        self.assertRaises(ValueError, unrar.clone, f, unrardll.Callback())
+
+    def test_clone_encrypted_headers(self):
+        import subprocess
+        from .bench import find_rar
+        rar = find_rar()
+        if not rar:
+            raise unittest.SkipTest('rar is needed to create an archive with encrypted headers')
+
+        class Counting(unrardll.Callback):
+            prompts = 0
+
+            def _get_password(self):
+                Counting.prompts += 1
+                return unrardll.Callback._get_password(self)
+
+        with TempDir() as tdir:
+            for name in ('a.txt', 'b.txt'):
+                with open(os.path.join(tdir, name), 'wb') as f:
+                    f.write(name.encode('ascii'))
+            path = os.path.join(tdir, 'hp.rar')
+            subprocess.check_call([rar, 'a', '-idq', '-ep1', '-hpsecret', path, os.path.join(tdir, 'a.txt'), os.path.join(tdir, 'b.txt')])
+            with open_archive(path, Counting('secret')) as f:
+                self.ae(unrar.read_next_header(f)['filename'], 'a.txt')
+                self.ae(Counting.prompts, 1)
+                g = unrar.clone(f, Counting())
+                self.ae(Counting.prompts, 1)
+                self.ae(unrar.read_next_header(g)['filename'], 'b.txt')
+                unrar.close_archive(g)
+
+    def test_async(self):
+        import asyncio
+        from unrardll.aio import WorkerPool, aheaders, aopen_member
+        pool = WorkerPool(threads=2)
+
+        async def member(name):
+            chunks = [c async for c in aopen_member(simple_rar, lambda h: h['filename'] == name, verify_data=True, pool=pool)]
+            return name, b''.join(chunks)
+
+        async def main():
+            hs = [h async for h in aheaders(simple_rar, batch_size=3, pool=pool)]
+            self.ae([h['filename'] for h in hs], list(names(simple_rar)))
+            results = await asyncio.gather(*[member(name) for name in sr_data if sr_data[name] and name != 'symlink'])
+            for name, data in results:
+                self.ae(data, sr_data[name])
+            self.ae(await member('missing'), ('missing', b''))
+            with self.assertRaises(PasswordRequired):
+                [c async for c in aopen_member(password_rar, lambda h: True, pool=pool)]
+            g = aopen_member(multipart_rar, lambda h: True, chunk_size=1024, max_chunks=1, pool=pool)
+            self.assertTrue(await g.__anext__())
+            await g.aclose()
+
+            # More interleaved streams than pool threads, each stalled on its consumer
+            single = WorkerPool(threads=1)
+            streams = [aopen_member(multipart_rar, lambda h: True, chunk_size=1024, max_chunks=1, pool=single) for i in range(4)]
+            for i in range(3):
+                for g in streams:
+                    self.assertTrue(await asyncio.wait_for(g.__anext__(), 10))
+            hs = [h async for h in aheaders(simple_rar, pool=single)]
+            self.ae(len(hs), len(sr_data))
+            for g in streams:
+                await g.aclose()
+
+            # Streams beyond the limit of the stream pool wait for a free thread
+            limited = WorkerPool(threads=1)
+            first, second = (aopen_member(
+                multipart_rar, lambda h: True, chunk_size=1024, max_chunks=1, pool=pool, stream_pool=limited) for i in range(2))
+            self.assertTrue(await first.__anext__())
+            pending = asyncio.ensure_future(second.__anext__())
+            await asyncio.sleep(0.1)
+            self.assertFalse(pending.done())
+            await first.aclose()
+            self.assertTrue(await asyncio.wait_for(pending, 10))
+            await second.aclose()
+
+        asyncio.run(main())
+
+    def test_extract_parallel(self):
+        from unrardll import plan_chunks
+        hs = [{'unpack_size': x} for x in (10, 10**9, 10, 10, 10)]
+        chunks = plan_chunks(hs, 4)
+        self.ae(chunks[0], (1, 2))
+        self.ae(sorted(chunks), [(0, 1), (1, 2), (2, 5)])
+        for v in (True, False):
+            with TempDir() as serial, TempDir() as parallel:
+                extract(simple_rar, serial, verify_data=v)
+                extract(simple_rar, parallel, verify_data=v, threads=4)
+                for dirpath, dirnames, filenames in os.walk(serial):
+                    for f in filenames:
+                        path = os.path.join(dirpath, f)
+                        with open(path, 'rb') as a, open(os.path.join(parallel, os.path.relpath(path, serial)), 'rb') as b:
+                            self.ae(a.read(), b.read())
+            with TempDir() as tdir:
+                extract(multipart_rar, tdir, verify_data=v, threads=4)
+                self.ae(os.listdir(tdir), ['Fifteen_Feet_of_Time.pdf'])
+
+    def test_extract_output_options(self):
+        for kw in ({'direct_io': True}, {'drop_cache': True}, {'write_behind': False}, {'direct_io': True, 'write_behind': True}):
+            with TempDir() as tdir:
+                extract(multipart_rar, tdir, verify_data=True, **kw)
+                h = next(headers(multipart_rar))
+                raw = open(os.path.join(tdir, h['filename']), 'rb').read()
+                self.ae(hashlib.sha1(raw).hexdigest(), 'a9fc6a11d000044f17fcdf65816348ce0be3b145')
+        with TempDir() as tdir, open_archive(simple_rar, unrardll.Callback(), mode=unrar.RAR_OM_EXTRACT) as f:
+            unrar.set_output_options(f, 1)
+            while True:
+                h = unrar.read_next_header(f)
+                if h is None:
+                    break
+                if h['is_dir'] or h['redir_type']:
+                    unrar.process_file(f, unrar.RAR_SKIP)
+                    continue
+                path = os.path.join(tdir, 'x')
+                with open(path, 'wb') as dest:
+                    unrar.process_file(f, unrar.RAR_TEST, dest.fileno(), False, None, h['unpack_size'])
+                with open(path, 'rb') as src:
+                    self.ae(src.read(), sr_data[h['filename']])
+
     def test_password(self):
         with TempDir() as tdir:
             self.assertRaises(PasswordRequired, extract, password_rar, tdir)
@@ -118,6 +599,63 @@ class BasicTests(TestCase):
             unrar.read_next_header(f)
             self.assertRaisesRegex(unrar.UNRARError,  "Processing canceled by the callback", unrar.process_file, f)
 
+    def test_zero_copy(self):
+        class Callback(object):
+            def __init__(self):
+                self.views, self.data = [], b''
+
+            def _process_data(self, x):
+                self.views.append(x)
+                self.data += x
+                return True
+        c = Callback()
+        with open_archive(simple_rar, c, mode=unrar.RAR_OM_EXTRACT) as f:
+            while unrar.read_next_header(f)['filename'] != 'one.txt':
+                unrar.process_file(f, unrar.RAR_SKIP)
+            unrar.process_file(f, unrar.RAR_TEST, -1, True)
+        self.ae(c.data, sr_data['one.txt'])
+        self.assertTrue(c.views)
+        for v in c.views:
+            self.assertIsInstance(v, memoryview)
+            self.assertRaises(ValueError, bytes, v)
+
+    def test_native_crc(self):
+        class Callback(object):
+            def _process_data(self, x):
+                return True
+        seen = set()
+        with open_archive(simple_rar, Callback(), mode=unrar.RAR_OM_EXTRACT) as f:
+            while True:
+                h = unrar.read_next_header(f)
+                if h is None:
+                    break
+                if h['is_dir'] or h['redir_type']:
+                    unrar.process_file(f, unrar.RAR_SKIP)
+                    continue
+                crc = unrar.process_file(f, unrar.RAR_TEST, -1, False, 0)
+                self.ae(crc, h['file_crc'] & 0xffffffff)
+                self.ae(crc, crc32(sr_data[h['filename']]) & 0xffffffff)
+                seen.add(h['filename'])
+        self.assertIn('one.txt', seen)
+
+    def test_output_buffer(self):
+        with open_archive(simple_rar, None, mode=unrar.RAR_OM_EXTRACT) as f:
+            while unrar.read_next_header(f)['filename'] != 'uncompressed':
+                unrar.process_file(f, unrar.RAR_SKIP)
+            self.assertIsNone(unrar.set_output_buffer(f, bytearray(10)))
+            buf = bytearray(b'x' * 20)
+            self.ae(unrar.set_output_buffer(f, None), 0)
+            unrar.set_output_buffer(f, buf, 2)
+            unrar.process_file(f)
+            self.ae(unrar.set_output_buffer(f), 2 + len(sr_data['uncompressed']))
+            self.ae(bytes(buf[2:-5]), sr_data['uncompressed'])
+            self.ae(bytes(buf[:2]), b'xx')
+            unrar.read_next_header(f)
+            unrar.set_output_buffer(f, bytearray(1))
+            self.assertRaisesRegex(unrar.UNRARError, 'The output buffer is too small', unrar.process_file, f)
+            self.assertRaises(ValueError, unrar.set_output_buffer, f, bytearray(1), 2)
+            self.assertRaises(BufferError, unrar.set_output_buffer, f, b'read-only')
+
     def test_multipart(self):
         self.ae(list(names(multipart_rar)), ['Fifteen_Feet_of_Time.pdf'])
         for v in (True, False):
@@ -131,6 +669,76 @@ class BasicTests(TestCase):
     def test_extract_member(self):
         self.ae(extract_member(simple_rar, lambda h: h['filename'] == 'one.txt', verify_data=True), ('one.txt', sr_data['one.txt']))
         self.ae(extract_member(simple_rar, lambda h: False), (None, None))
+        orig = unrardll.max_preallocated_member
+        unrardll.max_preallocated_member = 1
+        try:
+            self.ae(extract_member(simple_rar, lambda h: h['filename'] == 'one.txt', verify_data=True), ('one.txt', sr_data['one.txt']))
+        finally:
+            unrardll.max_preallocated_member = orig
+
+    def test_index(self):
+        with TempDir() as tdir:
+            orig = unrardll.index_cache_dir
+            unrardll.index_cache_dir = tdir
+            unrardll.index_memory_cache.clear()
+            try:
+                idx = archive_index(simple_rar)
+                self.ae([h['filename'] for h in idx.headers], list(names(simple_rar)))
+                self.ae([h['index'] for h in idx.headers], list(range(len(idx.headers))))
+                self.ae(len(os.listdir(tdir)), 1)
+                unrardll.index_memory_cache.clear()
+                self.ae(archive_index(simple_rar).headers, idx.headers)
+                for name in ('one.txt', 'uncompressed', '诶比屁.txt'):
+                    self.ae(extract_member(simple_rar, lambda h: h['filename'] == name, verify_data=True, use_index=True), (name, sr_data[name]))
+                self.ae(extract_member(simple_rar, lambda h: False, use_index=True), (None, None))
+                self.ae(extract_member(multipart_rar, lambda h: True, use_index=True)[0], 'Fifteen_Feet_of_Time.pdf')
+                self.ae(archive_index(multipart_rar).headers[0]['volume'], 0)
+                unrardll.index_memory_cache_size = 1
+                archive_index(simple_rar)
+                self.ae(list(unrardll.index_memory_cache), [os.path.abspath(simple_rar)])
+                before = len(os.listdir(tdir))
+                unrardll.ArchiveIndex(os.path.abspath('x.rar'), 1, 1, {'is_solid': False, 'encrypted_headers': True}, []).save()
+                self.ae(len(os.listdir(tdir)), before)
+            finally:
+                unrardll.index_cache_dir = orig
+                unrardll.index_memory_cache_size = 64
+                unrardll.index_memory_cache.clear()
+
+    def test_open_member(self):
+        with open_member(simple_rar, lambda h: h['filename'] == 'uncompressed', verify_data=True) as f:
+            self.ae(f.name, 'uncompressed')
+            self.ae(f.read(3), sr_data['uncompressed'][:3])
+            b = bytearray(4)
+            self.ae(f.readinto(b), 4)
+            self.ae(bytes(b), sr_data['uncompressed'][3:7])
+            self.ae(f.read(), sr_data['uncompressed'][7:])
+            self.ae(f.read(), b'')
+        self.assertIsNone(open_member(simple_rar, lambda h: False))
+        h = next(headers(multipart_rar))
+        with open_member(multipart_rar, lambda h: True, buffer_size=1024) as f:
+            raw = f.read()
+        self.ae(len(raw), h['unpack_size'])
+        self.ae(hashlib.sha1(raw).hexdigest(), 'a9fc6a11d000044f17fcdf65816348ce0be3b145')
+        with open_member(multipart_rar, lambda h: True, buffer_size=1024) as f:
+            self.ae(len(f.read(10)), 10)
+
+        def read_protected():
+            with open_member(password_rar, lambda h: True) as f:
+                return f.read()
+        self.assertRaises(PasswordRequired, read_protected)
+
+    def test_memory_archive(self):
+        import io
+        from unrardll import MemoryArchive
+        with open(simple_rar, 'rb') as f:
+            raw = f.read()
+        for data in (raw, bytearray(raw), io.BytesIO(raw)):
+            with MemoryArchive(data) as path:
+                self.ae(list(names(path)), list(names(simple_rar)))
+                self.ae(comment(path), 'some comment\n')
+                self.ae(extract_member(path, lambda h: h['filename'] == 'one.txt'), ('one.txt', sr_data['one.txt']))
+        with open(password_rar, 'rb') as f, MemoryArchive(f) as path:
+            self.assertRaises(PasswordRequired, extract_member, path, lambda h: True)
 
     def test_extract_members(self):
         data = {'one.txt': b'', 'uncompressed': b''}
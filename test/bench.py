@@ -0,0 +1,182 @@
+#!/usr/bin/env python
+# vim:fileencoding=utf-8
+# License: BSD Copyright: 2017, Kovid Goyal <kovid at kovidgoyal.net>
+
+from __future__ import absolute_import, division, print_function, unicode_literals
+
+import json
+import os
+import platform
+import random
+import shutil
+import subprocess
+import sys
+import time
+
+from unrardll import extract, extract_member, headers, names, unrar
+
+from . import TempDir, base
+
+try:
+    import resource
+except ImportError:
+    resource = None
+
+PASSWORD = 'benchmark'
+
+
+def find_rar():
+    ans = os.environ.get('RAR_EXE')
+    if ans:
+        return ans
+    for d in os.environ.get('PATH', '').split(os.pathsep):
+        for name in ('rar', 'rar.exe', 'Rar.exe'):
+            q = os.path.join(d, name)
+            if os.path.isfile(q) and os.access(q, os.X_OK):
+                return q
+
+
+def peak_rss_kb():
+    if resource is None:
+        return None
+    ans = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    # macOS reports bytes, everything else kilobytes
+    return ans // 1024 if sys.platform == 'darwin' else ans
+
+
+def write_files(root, count, size, seed):
+    # Text-like data, so that it compresses about as well as real content.
+    # Written to a temporary directory first, so that an interrupted run does
+    # not leave a partial source tree behind to be re-used.
+    rnd = random.Random(seed)
+    words = [''.join(rnd.choice('abcdefghijklmnopqrstuvwxyz') for i in range(rnd.randint(2, 10))).encode('ascii') for i in range(512)]
+    # Words average more than six bytes with the separator
+    per_chunk = min(65536, size // 6 + 1)
+    tmp = root + '.tmp'
+    if os.path.exists(tmp):
+        shutil.rmtree(tmp)
+    for i in range(count):
+        d = os.path.join(tmp, 'd%03d' % (i % 97))
+        if not os.path.exists(d):
+            os.makedirs(d)
+        with open(os.path.join(d, 'f%06d.txt' % i), 'wb') as f:
+            written = 0
+            while written < size:
+                chunk = b' '.join(rnd.choices(words, k=per_chunk))[:size - written]
+                f.write(chunk)
+                written += len(chunk)
+    os.rename(tmp, root)
+
+
+def generate_corpora(rar, workdir):
+    '''
+    Create representative archives using the rar command line tool. The
+    archives and the files they are made from are kept in workdir, pass
+    --corpus-dir to re-use them across runs.
+    '''
+    src = os.path.join(workdir, 'src')
+    specs = (
+        # name, file count, file size, extra rar switches
+        ('tiny_files', 5000, 200, []),
+        ('tiny_files_solid', 5000, 200, ['-s']),
+        ('huge_files', 2, 128 * 1024 * 1024, []),
+        ('mixed_solid', 500, 64 * 1024, ['-s']),
+        ('multi_volume', 40, 1024 * 1024, ['-v8m']),
+        ('encrypted', 500, 16 * 1024, ['-p' + PASSWORD]),
+        ('encrypted_headers', 500, 16 * 1024, ['-hp' + PASSWORD]),
+    )
+    ans = {}
+    for name, count, size, switches in specs:
+        out = os.path.join(workdir, name + '.rar')
+        first = os.path.join(workdir, name + '.part1.rar') if '-v8m' in switches else out
+        if not os.path.exists(first):
+            d = os.path.join(src, '%d-%d' % (count, size))
+            if not os.path.exists(d):
+                write_files(d, count, size, count * size)
+            subprocess.check_call([rar, 'a', '-r', '-idq', '-ep1', '-m3'] + switches + [out, os.path.join(d, '*')])
+        out = first
+        ans[name] = {'path': out, 'password': PASSWORD if any(x.startswith(('-p', '-hp')) for x in switches) else None}
+    return ans
+
+
+def bundled_corpora():
+    ' The archives from the test suite, used when rar is not available '
+    return {
+        'simple': {'path': os.path.join(base, 'simple.rar'), 'password': None},
+        'multi_volume': {'path': os.path.join(base, 'example_split_archive.part1.rar'), 'password': None},
+        'encrypted': {'path': os.path.join(base, 'example_password_protected.rar'), 'password': 'example'},
+    }
+
+
+def timeit(func, min_time=0.5, max_repeat=1000):
+    ' Return the median time for a call of func, repeating until min_time has elapsed '
+    times = []
+    start = time.time()
+    while len(times) < max_repeat and (not times or time.time() - start < min_time):
+        t = time.time()
+        func()
+        times.append(time.time() - t)
+    times.sort()
+    return times[len(times) // 2], len(times)
+
+
+def bench_archive(path, password, workdir, min_time):
+    all_headers = list(headers(path, password=password))
+    files = [h for h in all_headers if not h['is_dir']]
+    total = sum(h['unpack_size'] for h in files)
+    ans = {'files': len(files), 'unpack_size': total}
+
+    t, n = timeit(lambda: list(names(path, password=password)), min_time)
+    ans['names_headers_per_sec'] = len(all_headers) / t if t else None
+    ans['names_runs'] = n
+
+    def do_extract(**kw):
+        dest = os.path.join(workdir, 'extract')
+        if os.path.exists(dest):
+            shutil.rmtree(dest)
+        os.mkdir(dest)
+        extract(path, dest, password=password, **kw)
+
+    for key, kw in (
+        ('extract', {}),
+        ('extract_verify', {'verify_data': True}),
+        ('extract_threads', {'threads': 4}),
+    ):
+        t, n = timeit(lambda: do_extract(**kw), min_time, max_repeat=20)
+        ans[key + '_mb_per_sec'] = total / t / (1024 * 1024) if t else None
+        ans[key + '_runs'] = n
+
+    if files:
+        last = files[-1]['filename']
+        t, n = timeit(lambda: extract_member(path, lambda h: h['filename'] == last, password=password), min_time, max_repeat=50)
+        ans['extract_member_latency_sec'] = t
+        t, n = timeit(lambda: extract_member(path, lambda h: h['filename'] == last, password=password, use_index=True), min_time, max_repeat=50)
+        ans['extract_member_indexed_latency_sec'] = t
+    return ans
+
+
+def main(output='bench_output.json', corpus_dir=None, min_time=0.5):
+    with TempDir() as tdir:
+        workdir = corpus_dir or os.path.join(tdir, 'corpus')
+        if not os.path.exists(workdir):
+            os.makedirs(workdir)
+        rar = find_rar()
+        corpora = generate_corpora(rar, workdir) if rar else bundled_corpora()
+        results = {
+            'generated': bool(rar),
+            'python': sys.version.split()[0],
+            'platform': platform.platform(),
+            'unrar_dll_version': unrar.RARDllVersion,
+            'archives': {},
+        }
+        for name, c in sorted(corpora.items()):
+            print('Benchmarking', name, '...', flush=True)
+            results['archives'][name] = bench_archive(c['path'], c['password'], tdir, min_time)
+        results['stats'] = unrar.stats()
+        # The peak for the whole process, the archives are benchmarked in it one after the other
+        results['peak_rss_kb'] = peak_rss_kb()
+    raw = json.dumps(results, indent=2, sort_keys=True)
+    with open(output, 'w') as f:
+        f.write(raw)
+    print(raw)
+    return results